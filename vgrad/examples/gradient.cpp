@@ -8,7 +8,7 @@ const float lr = 0.1;  // learning rate
 auto f(const auto x) { return pow(x - 3, 2); }  // f(x) = (x - 3)^2
 
 int main() {
-    Tensor<ScalarShape, float> x{0};
+    Param<ScalarShape, float> x{0};
 
     for (int i = 0; i < epochs; i++) {
         auto y = f(x);
@@ -17,7 +17,7 @@ class ScalarModel {
     }
 
    private:
-    Tensor<ScalarShape, DType> coeff = randn<DType, ScalarShape>();
+    Param<ScalarShape, DType> coeff = randn<DType, ScalarShape>().as_param();
 };
 
 template <Number DType, int degree>
@@ -34,7 +34,7 @@ class PolynomialModel {
     }
 
    private:
-    Tensor<ScalarShape, DType> coeff = randn<DType, ScalarShape>();
+    Param<ScalarShape, DType> coeff = randn<DType, ScalarShape>().as_param();
 
     using NextModel = std::conditional_t<degree - 1 == 0, ScalarModel<DType>, PolynomialModel<DType, degree - 1>>;
     NextModel next;
@@ -61,9 +61,9 @@ class SinusoidalModel {
     }
 
    private:
-    Tensor<ScalarShape, DType> A = randn<DType, ScalarShape>();
-    Tensor<ScalarShape, DType> B = randn<DType, ScalarShape>();
-    Tensor<ScalarShape, DType> C = randn<DType, ScalarShape>();
+    Param<ScalarShape, DType> A = randn<DType, ScalarShape>().as_param();
+    Param<ScalarShape, DType> B = randn<DType, ScalarShape>().as_param();
+    Param<ScalarShape, DType> C = randn<DType, ScalarShape>().as_param();
 };
 
 template <Number DType>
@@ -184,9 +184,8 @@ int main() {
         for (int epoch = 0; epoch < epochs; epoch++) {
             PROFILE_SCOPE("epoch");
 
-            auto y_hat = model(x, y);
-            auto l = loss(y, y_hat);
-            optimizer.step(l);
+            // seven scalar parameters: forward mode gets their gradients in the same pass as the loss, with no graph
+            auto l = optimizer.step_forward([&] { return loss(y, model(x, y)); });
 
             if (epoch % 20 == 0) {
                 std::cerr << "Epoch " << epoch << "\tLoss: " << l.value() << std::endl;
@@ -194,6 +193,7 @@ int main() {
         }
 
         if (epochs > 0) {
+            NoGradGuard no_grad;
             auto denoised = model.denoise(x);
             auto last_x = x[Dim::value - 1];
             auto last_denoised_y = denoised[Dim::value - 1];
@@ -0,0 +1,217 @@
+#ifndef VGRAD_ALLOCATOR_H_
+#define VGRAD_ALLOCATOR_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "elementwise.h"
+#include "profile.h"
+
+namespace vgrad {
+
+// blocks at least this large are first-touched in parallel: about the smallest buffer the kernels split across threads
+inline constexpr std::size_t _first_touch_bytes = kernel::grain_size * sizeof(float);
+
+// Write one byte per page, with the static schedule the element-wise kernels use, so that on NUMA machines each page
+// of a fresh block lands near the thread that will later work on it.
+inline void _first_touch(void* p, std::size_t bytes) {
+    constexpr std::size_t page = 4096;
+    auto data = static_cast<volatile std::byte*>(p);
+    const std::size_t pages = (bytes + page - 1) / page;
+
+#pragma omp parallel for schedule(static) if (bytes >= _first_touch_bytes)
+    for (std::size_t i = 0; i < pages; i++) data[i * page] = std::byte{0};
+}
+
+// Freed blocks beyond what one thread's cache keeps, for any thread to take. A thread can end up freeing more blocks
+// than it allocates, e.g. when backward() frees gradients in tasks on other threads (see _BackwardPass::run_tasks()); its
+// surplus comes here, and the threads short of blocks take it back, so no cache grows step after step.
+class _SharedPool {
+   public:
+    _SharedPool() = default;
+    _SharedPool(const _SharedPool&) = delete;
+    _SharedPool& operator=(const _SharedPool&) = delete;
+
+    ~_SharedPool() { release(); }
+
+    // Move the blocks of the given size class in.
+    void put(std::size_t size, std::vector<void*>::iterator first, std::vector<void*>::iterator last) {
+        std::lock_guard lock{mutex_};
+        auto& blocks = free_[size];
+        blocks.insert(blocks.end(), first, last);
+    }
+
+    // Move up to count blocks of the given size class out, onto blocks.
+    void take(std::size_t size, std::size_t count, std::vector<void*>& blocks) {
+        std::lock_guard lock{mutex_};
+        auto it = free_.find(size);
+        if (it == free_.end()) return;
+        auto& source = it->second;
+        const auto n = std::min(count, source.size());
+        blocks.insert(blocks.end(), source.end() - n, source.end());
+        source.resize(source.size() - n);
+    }
+
+    // Return every block to the heap.
+    void release();
+
+   private:
+    std::mutex mutex_;
+    std::unordered_map<std::size_t, std::vector<void*>> free_;
+};
+
+inline _SharedPool _shared_pool;
+
+// Keeps freed blocks in free lists keyed by their size, and hands them out again instead of going back to the heap.
+// Tensor shapes are fixed at compile time, so a training loop asks for the same sizes every step, and once the first
+// step has filled the lists it stops calling malloc for tensors. Each thread has its own cache, so threads only contend
+// when a free list outgrows max_blocks and spills into the _SharedPool, or runs dry and refills from it. The
+// hit/miss and cached-bytes counters are in profile::allocator_counters.
+class _StorageCache {
+   public:
+    // every block starts on a cache line
+    static constexpr std::size_t alignment = 64;
+
+    // blocks of one size that a thread keeps to itself
+    static constexpr std::size_t max_blocks = 32;
+
+    static constexpr std::size_t size_class(std::size_t bytes) {
+        return (bytes + alignment - 1) / alignment * alignment;
+    }
+
+    _StorageCache() = default;
+    _StorageCache(const _StorageCache&) = delete;
+    _StorageCache& operator=(const _StorageCache&) = delete;
+
+    ~_StorageCache();
+
+    void* allocate(std::size_t bytes) {
+        auto& counters = profile::allocator_counters;
+        const std::size_t size = size_class(bytes);
+
+        auto& blocks = free_[size];
+        if (blocks.empty()) _shared_pool.take(size, max_blocks / 2, blocks);
+        if (!blocks.empty()) {
+            void* p = blocks.back();
+            blocks.pop_back();
+            counters.hits.fetch_add(1, std::memory_order_relaxed);
+            counters.bytes_cached.fetch_sub(size, std::memory_order_relaxed);
+            return p;
+        }
+
+        counters.misses.fetch_add(1, std::memory_order_relaxed);
+        void* p = ::operator new(size, std::align_val_t{alignment});
+        if (size >= _first_touch_bytes) _first_touch(p, size);
+        return p;
+    }
+
+    void deallocate(void* p, std::size_t bytes) {
+        const std::size_t size = size_class(bytes);
+        auto& blocks = free_[size];
+        blocks.push_back(p);
+        profile::allocator_counters.bytes_cached.fetch_add(size, std::memory_order_relaxed);
+
+        // keep the most recently freed half, which is likelier to still be in this core's cache
+        if (blocks.size() > max_blocks) {
+            const auto keep = blocks.end() - max_blocks / 2;
+            _shared_pool.put(size, blocks.begin(), keep);
+            blocks.erase(blocks.begin(), keep);
+        }
+    }
+
+    // Return every cached block to the heap.
+    void release() {
+        std::size_t released = 0;
+        for (auto& [size, blocks] : free_) {
+            for (void* p : blocks) ::operator delete(p, std::align_val_t{alignment});
+            released += size * blocks.size();
+            blocks.clear();
+        }
+        profile::allocator_counters.bytes_cached.fetch_sub(released, std::memory_order_relaxed);
+    }
+
+   private:
+    std::unordered_map<std::size_t, std::vector<void*>> free_;
+};
+
+inline void _SharedPool::release() {
+    std::lock_guard lock{mutex_};
+    std::size_t released = 0;
+    for (auto& [size, blocks] : free_) {
+        for (void* p : blocks) ::operator delete(p, std::align_val_t{_StorageCache::alignment});
+        released += size * blocks.size();
+        blocks.clear();
+    }
+    profile::allocator_counters.bytes_cached.fetch_sub(released, std::memory_order_relaxed);
+}
+
+inline thread_local _StorageCache _storage_cache;
+// set once this thread's cache is gone, so blocks freed after it (e.g. by static tensors) go straight to the heap
+inline thread_local bool _storage_cache_destroyed = false;
+
+inline _StorageCache::~_StorageCache() {
+    release();
+    _storage_cache_destroyed = true;
+}
+
+// Return the blocks cached by the calling thread, and those in the shared pool, to the heap.
+inline void empty_cache() {
+    if (!_storage_cache_destroyed) _storage_cache.release();
+    _shared_pool.release();
+}
+
+// Allocates through the calling thread's _StorageCache.
+template <typename T>
+struct CachingAllocator {
+    static_assert(alignof(T) <= _StorageCache::alignment);
+
+    using value_type = T;
+
+    CachingAllocator() = default;
+
+    template <typename U>
+    CachingAllocator(const CachingAllocator<U>&) {}
+
+    T* allocate(std::size_t n) {
+        if (_storage_cache_destroyed) {
+            return static_cast<T*>(
+                ::operator new(_StorageCache::size_class(n * sizeof(T)), std::align_val_t{_StorageCache::alignment}));
+        }
+        return static_cast<T*>(_storage_cache.allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n) {
+        if (_storage_cache_destroyed) {
+            ::operator delete(p, std::align_val_t{_StorageCache::alignment});
+        } else {
+            _storage_cache.deallocate(p, n * sizeof(T));
+        }
+    }
+
+    template <typename U>
+    bool operator==(const CachingAllocator<U>&) const {
+        return true;
+    }
+};
+
+// std::make_shared through the caching allocator; the control block shares the cached block
+template <typename T, typename... Args>
+std::shared_ptr<T> _make_cached(Args&&... args) {
+    return std::allocate_shared<T>(CachingAllocator<T>{}, std::forward<Args>(args)...);
+}
+
+// the same, leaving the object default-initialized (e.g. an array's elements uninitialized)
+template <typename T>
+std::shared_ptr<T> _make_cached_for_overwrite() {
+    return std::allocate_shared_for_overwrite<T>(CachingAllocator<T>{});
+}
+
+}  // namespace vgrad
+
+#endif  // VGRAD_ALLOCATOR_H_
@@ -0,0 +1,166 @@
+#ifndef VGRAD_ARENA_H_
+#define VGRAD_ARENA_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "allocator.h"
+#include "capture.h"
+
+namespace vgrad {
+
+// A bump allocator for the tensors of one training step. While an ArenaScope is active, tensor buffers and graph nodes
+// are carved out of one preallocated block: allocating bumps a pointer, freeing does nothing, and reset() releases the
+// whole step at once. Allocations that don't fit fall back to the caching allocator (see overflows()).
+//
+// Everything allocated from the arena must be gone before reset(); reset() throws otherwise. Tensors that outlive a
+// step (parameters, optimizer state) must be created outside the scope. That includes parameters: only their graph
+// node is kept off the arena, while their data is wherever it was allocated, so randn<...>().as_param() inside a
+// scope would take its data from the arena.
+//
+//   using Loss = decltype(loss_fn(model(x), y));
+//   Arena arena{arena_capacity(Loss::mem_complexity)};
+//   for (...) {
+//       arena.reset();
+//       ArenaScope arena_scope{arena};
+//       optimizer.step(loss_fn(model(x), y));
+//   }
+class Arena {
+   public:
+    // every allocation starts on a cache line
+    static constexpr std::size_t alignment = 64;
+
+    explicit Arena(std::size_t capacity)
+        : capacity_{round_up(capacity)},
+          buffer_{static_cast<std::byte*>(::operator new(capacity_, std::align_val_t{alignment}))} {
+        _first_touch(buffer_, capacity_);
+    }
+
+    ~Arena() { ::operator delete(buffer_, std::align_val_t{alignment}); }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // nullptr if the arena is full
+    void* allocate(std::size_t bytes) {
+        const std::size_t start = offset_;
+        const std::size_t end = round_up(start + bytes);
+        if (end > capacity_) {
+            overflows_++;
+            return nullptr;
+        }
+        offset_ = end;
+        peak_ = std::max(peak_, offset_);
+        live_.fetch_add(1, std::memory_order_relaxed);
+        return buffer_ + start;
+    }
+
+    // may be called from any thread, e.g. by the tasks of a parallel backward pass
+    void deallocate(void*) { live_.fetch_sub(1, std::memory_order_relaxed); }
+
+    bool owns(const void* p) const { return p >= buffer_ && p < buffer_ + capacity_; }
+
+    void reset() {
+        if (const std::size_t live = live_.load(); live != 0) {
+            throw std::runtime_error("Arena reset with " + std::to_string(live) + " allocations still alive");
+        }
+        offset_ = 0;
+    }
+
+    std::size_t capacity() const { return capacity_; }
+    // bytes in use, and the most in use at once since the arena was created
+    std::size_t used() const { return offset_; }
+    std::size_t peak() const { return peak_; }
+    // allocations that didn't fit, and went to the caching allocator
+    std::size_t overflows() const { return overflows_; }
+
+   private:
+    static constexpr std::size_t round_up(std::size_t n) { return (n + alignment - 1) / alignment * alignment; }
+
+    const std::size_t capacity_;
+    std::byte* const buffer_;
+    std::size_t offset_ = 0;
+    std::size_t peak_ = 0;
+    std::atomic<std::size_t> live_ = 0;
+    std::size_t overflows_ = 0;
+};
+
+// Room for a graph with the given memory complexity (e.g. Tensor::mem_complexity), and as much again for the
+// gradients that flow back through it.
+constexpr std::size_t arena_capacity(const auto& mem_complexity) { return 2 * mem_complexity.total.value; }
+
+// Draws from an arena, or from the caching allocator once the arena is full.
+template <typename T>
+struct ArenaAllocator {
+    using value_type = T;
+
+    Arena* arena;
+
+    explicit ArenaAllocator(Arena* arena) : arena{arena} {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena{other.arena} {}
+
+    T* allocate(std::size_t n) {
+        if (void* p = arena->allocate(n * sizeof(T))) return static_cast<T*>(p);
+        return CachingAllocator<T>{}.allocate(n);
+    }
+
+    void deallocate(T* p, std::size_t n) {
+        if (arena->owns(p)) {
+            arena->deallocate(p);
+        } else {
+            CachingAllocator<T>{}.deallocate(p, n);
+        }
+    }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const {
+        return arena == other.arena;
+    }
+};
+
+inline thread_local Arena* _current_arena = nullptr;
+
+// Makes tensors created on this thread draw from an arena, for as long as it is alive. Scopes nest.
+class ArenaScope {
+   public:
+    explicit ArenaScope(Arena& arena) : previous_{_current_arena} { _current_arena = &arena; }
+    ~ArenaScope() { _current_arena = previous_; }
+
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+
+   private:
+    Arena* const previous_;
+};
+
+// std::make_shared, from the current arena if there is one, else from the caching allocator; the control block shares
+// the allocation. A capture (see CapturedStep) keeps its buffers past the step, so while one is active the arena is
+// skipped.
+template <typename T, typename... Args>
+std::shared_ptr<T> _make_shared(Args&&... args) {
+    if (Arena* arena = _current_arena; arena && !_current_capture) {
+        return std::allocate_shared<T>(ArenaAllocator<T>{arena}, std::forward<Args>(args)...);
+    }
+    return _make_cached<T>(std::forward<Args>(args)...);
+}
+
+// std::make_shared_for_overwrite, from the same place as _make_shared()
+template <typename T>
+std::shared_ptr<T> _make_shared_for_overwrite() {
+    if (Arena* arena = _current_arena; arena && !_current_capture) {
+        return std::allocate_shared_for_overwrite<T>(ArenaAllocator<T>{arena});
+    }
+    return _make_cached_for_overwrite<T>();
+}
+
+}  // namespace vgrad
+
+#endif  // VGRAD_ARENA_H_
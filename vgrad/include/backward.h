@@ -1,19 +1,89 @@
 #ifndef VGRAD_BACKWARD_H_
 #define VGRAD_BACKWARD_H_
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
+#include "capture.h"
 #include "create_tensor.h"
+#include "elementwise.h"
+#include "grad_mode.h"
 #include "graph.h"
 
 namespace vgrad {
 
+// Collects the gradient of one tensor during a backward pass. Gradients are added in place, and nothing is zeroed
+// ahead of the pass: without a buffer of its own, the holder moves in the first gradient to arrive; with one, the first
+// gradient to arrive is copied over it, unless the holder accumulates onto what the buffer holds.
 template <IsTensor T>
-struct GradientHolder {
+class GradientHolder {
+   public:
+    using Gradient = typename T::Contiguous;
+
     const T tensor;
-    typename T::Detached gradient;
 
-    GradientHolder(const T& tensor) : tensor{tensor}, gradient{zeros_like(tensor)} {}
+    GradientHolder(const T& tensor) : tensor{tensor} {}
+
+    // into an existing buffer (e.g. a view into a FlatParams gradient buffer)
+    GradientHolder(const T& tensor, const Gradient& buffer, bool accumulate)
+        : tensor{tensor}, data_{buffer.get_data()}, owned_{true}, arrived_{accumulate} {}
+
+    // Add a gradient. Safe to call from several threads: the pass of a checkpointed segment may reach the tensor while
+    // the outer pass does.
+    void add(const Gradient& gradient) {
+        std::lock_guard lock{*mutex_};
+        if (!data_) {
+            data_ = gradient.get_data();
+            arrived_ = true;
+            return;
+        }
+
+        auto data = data_->data();
+        auto gradient_data = gradient.flat_view().data();
+        if (!arrived_) {
+            kernel::elementwise<T::Shape::flat_size>([=](Size i) { data[i] = gradient_data[i]; });
+            arrived_ = true;
+        } else if (owned_) {
+            kernel::elementwise<T::Shape::flat_size>([=](Size i) { data[i] += gradient_data[i]; });
+        } else {
+            // a gradient moved in may be shared with other tensors, so the sum goes to a new buffer
+            Gradient sum{uninitialized};
+            auto sum_data = sum._flat_data().data();
+            kernel::elementwise<T::Shape::flat_size>([=](Size i) { sum_data[i] = data[i] + gradient_data[i]; });
+            data_ = sum.get_data();
+            owned_ = true;
+        }
+    }
+
+    // The gradient, once the pass is over: zeros if none arrived.
+    Gradient gradient() {
+        if (!data_) return zeros_like(tensor);
+        if (!arrived_) {
+            auto data = data_->data();
+            kernel::elementwise<T::Shape::flat_size>([=](Size i) { data[i] = 0; });
+            arrived_ = true;
+        }
+        return Gradient{data_};
+    }
+
+   private:
+    std::shared_ptr<typename Gradient::Storage> data_;
+    // whether data_ is ours to write into
+    bool owned_ = false;
+    // whether data_ holds gradients of this pass (or ones to accumulate onto), rather than stale values
+    bool arrived_ = false;
+    std::unique_ptr<std::mutex> mutex_ = std::make_unique<std::mutex>();
 };
 
 template <IsNode Node, IsTensor Param>
@@ -21,35 +91,454 @@ auto accumulate_grad(const std::shared_ptr<Node> node,
                      const Tensor<typename Node::OutShape, typename Node::DType>& d_loss_d_out,
                      GradientHolder<Param>& grad_holder) {
     if constexpr (std::is_same_v<typename Param::Node, Node>) {
-        if (grad_holder.tensor.get_node() == node)
-            grad_holder.gradient = (grad_holder.gradient + d_loss_d_out).detach();
+        if (grad_holder.tensor.get_node() == node) grad_holder.add(d_loss_d_out);
     }
 }
 
-template <IsNode Node, IsTensor... Params>
-void backward_rec(const std::shared_ptr<Node> node,
-                  const Tensor<typename Node::OutShape, typename Node::DType>& d_loss_d_out,
-                  GradientHolder<Params>&... grad_holders) {
-    (accumulate_grad(node, d_loss_d_out, grad_holders), ...);
+// A checkpointed segment runs again from these: a fresh parameter for an input that requires a gradient, and the
+// input itself otherwise.
+template <IsTensor T>
+auto _checkpoint_leaf(const T& input) {
+    if constexpr (T::requires_grad) {
+        return input.detach().as_param();
+    } else {
+        return input;
+    }
+}
+
+template <IsTensor T>
+auto _checkpoint_holder(const T& leaf) {
+    if constexpr (T::requires_grad) {
+        return std::make_tuple(GradientHolder<T>{leaf});
+    } else {
+        return std::tuple<>{};
+    }
+}
 
-    if constexpr (IsUnaryNode<Node>) {
-        auto d_loss_d_in = node->grad_fn(d_loss_d_out);
-        backward_rec(node->in_node, d_loss_d_in, grad_holders...);
-    } else if constexpr (IsBinaryNode<Node>) {
-        auto [d_loss_d_in1, d_loss_d_in2] = node->grad_fn(d_loss_d_out);
-        backward_rec(node->in_node1, d_loss_d_in1, grad_holders...);
-        backward_rec(node->in_node2, d_loss_d_in2, grad_holders...);
+// The most elements a node's backward step reads or writes: its own gradient, or an input's. (The inputs of a fused
+// node are broadcast up to its shape, so they are never larger.)
+template <IsNode Node>
+constexpr Size _backward_size() {
+    Size result = Node::OutShape::flat_size;
+    if constexpr (requires { typename Node::InShape; }) {
+        result = std::max(result, Node::InShape::flat_size);
     }
+    if constexpr (requires { typename Node::InShape1; }) {
+        result = std::max({result, Node::InShape1::flat_size, Node::InShape2::flat_size});
+    }
+    return result;
 }
 
+// Whether a node's backward step is too small for the kernels to split across threads (see kernel::grain_size), so
+// that a parallel pass runs it beside other steps instead. Views cost nothing forward, but their backward step is as
+// large as their shape (e.g. summing the gradient of a broadcast), so the size counts as well as the time.
+template <IsNode Node>
+constexpr bool _runs_alongside() {
+    if constexpr (IsCheckpointNode<Node>) {
+        // runs a whole segment again
+        return false;
+    } else if constexpr (requires { Node::ThisTimeComplexity::total; }) {
+        return Node::ThisTimeComplexity::total.value <= kernel::grain_size &&
+               _backward_size<Node>() <= kernel::grain_size;
+    } else {
+        return _backward_size<Node>() <= kernel::grain_size;
+    }
+}
+
+// Whether a backward pass may run independent branches on several threads: not from inside a parallel region (e.g. in
+// the nested pass of a checkpointed segment), and not while a capture records the kernels run on this thread.
+inline bool _parallel_backward() {
+#ifdef _OPENMP
+    return omp_get_max_threads() > 1 && !omp_in_parallel() && !_current_capture;
+#else
+    return false;
+#endif
+}
+
+// One reverse-mode pass over the graph below a root. Every node is visited once, however many paths reach it: the
+// gradients arriving at a node are summed, and its grad_fn runs once, after all the nodes that feed it a gradient. A
+// node's gradient is freed as soon as its grad_fn has used it. Nodes with no parameter below them are skipped, and
+// constant subgraphs (see Param) aren't even instantiated.
+//
+// With several OpenMP threads, independent branches run at the same time. Nodes too small for their kernels to use the
+// whole team (see _runs_alongside()) run as tasks as soon as their gradient is complete, and idle threads pick them
+// up; larger nodes run one at a time, their kernels splitting across the team. A node sums the gradients it receives
+// in the order a single thread would deliver them, so the result doesn't depend on the schedule.
+template <IsTensor... Params>
+class _BackwardPass {
+   public:
+    _BackwardPass(GradientHolder<Params>&... grad_holders) : grad_holders_{grad_holders...} {}
+
+    template <IsNode Node>
+    void run(const std::shared_ptr<Node> root,
+             const Tensor<typename Node::OutShape, typename Node::DType>& d_loss_d_root) {
+        if (!visit(root)) return;
+        rank_edges();
+
+        parallel_ = _parallel_backward();
+        grad_enabled_ = is_grad_enabled();
+        Slot& root_slot = slots_.at(root.get());
+        add_grad(root_slot, root_slot.edges++, d_loss_d_root);
+
+        if (parallel_) {
+            run_parallel();
+        } else {
+            // order_ lists every node after its inputs, so walking it backwards runs each node after all its consumers
+            for (auto it = order_.rbegin(); it != order_.rend(); it++) (*it)->backprop();
+        }
+    }
+
+   private:
+    struct Slot;
+
+    // where a gradient goes: the slot of the input (null if the input needs none), and the gradient's rank there
+    struct Edge {
+        Slot* slot = nullptr;
+        std::size_t rank = 0;
+    };
+
+    struct Slot {
+        // runs the node's grad_fn and passes its gradients on
+        std::function<void()> backprop;
+        // one per input of the node, in the order the grad_fn returns their gradients
+        std::vector<Edge> edges_out;
+        // position in order_
+        std::size_t position = 0;
+        // whether a parameter is at or below the node
+        bool needed = false;
+        // see _runs_alongside()
+        bool alongside = false;
+        // gradients the node receives
+        std::size_t edges = 0;
+
+        std::mutex mutex;
+        // storage of the gradient summed so far, if any has arrived
+        std::shared_ptr<void> gradient;
+        // whether gradient is a buffer of our own, which later arrivals can be added into
+        bool owned = false;
+        // gradients summed so far, which are summed in order of rank
+        std::size_t summed = 0;
+        // gradients that arrived before their turn, by rank
+        std::vector<std::shared_ptr<void>> early;
+    };
+
+    std::tuple<GradientHolder<Params>&...> grad_holders_;
+    std::unordered_map<const void*, Slot> slots_;
+    std::vector<Slot*> order_;
+
+    bool parallel_ = false;
+    bool grad_enabled_ = true;
+    // set while nodes run as tasks
+    bool in_tasks_ = false;
+    // nodes whose gradient is complete, but that haven't run yet (parallel passes only)
+    std::vector<Slot*> ready_;
+    std::mutex ready_mutex_;
+    // the first exception a task threw
+    std::exception_ptr error_;
+
+    template <IsNode Node>
+    bool is_param(const std::shared_ptr<Node>& node) const {
+        return std::apply(
+            [&](const auto&... grad_holders) {
+                return ((static_cast<const void*>(grad_holders.tensor.get_node().get()) == node.get()) || ...);
+            },
+            grad_holders_);
+    }
+
+    // Collect the nodes below node, in post-order. Returns whether the node needs a gradient.
+    template <IsNode Node>
+        requires Node::requires_grad
+    bool visit(const std::shared_ptr<Node> node) {
+        // computed under a NoGradGuard
+        if (!node) return false;
+
+        auto [it, inserted] = slots_.try_emplace(node.get());
+        // references to map elements survive the insertions made while visiting the inputs
+        Slot& slot = it->second;
+        if (!inserted) return slot.needed;
+
+        bool needed = is_param(node);
+        if constexpr (IsUnaryNode<Node>) {
+            needed |= visit(node->in_node);
+            slot.edges_out = {edge_to(node->in_node)};
+        } else if constexpr (IsBinaryNode<Node>) {
+            needed |= visit(node->in_node1);
+            needed |= visit(node->in_node2);
+            slot.edges_out = {edge_to(node->in_node1), edge_to(node->in_node2)};
+        } else if constexpr (IsFusedNode<Node>) {
+            std::apply(
+                [&](const auto&... in_nodes) {
+                    ((needed |= visit(in_nodes)), ...);
+                    slot.edges_out = {edge_to(in_nodes)...};
+                },
+                node->in_nodes);
+        } else if constexpr (IsCheckpointNode<Node>) {
+            std::apply(
+                [&](const auto&... inputs) {
+                    ((needed |= visit(inputs.get_node())), ...);
+                    slot.edges_out = {edge_to(inputs.get_node())...};
+                },
+                node->inputs);
+            // the parameters the segment uses directly only show up once it runs again
+            needed = true;
+        }
+
+        slot.needed = needed;
+        if (needed) {
+            slot.position = order_.size();
+            slot.alongside = _runs_alongside<Node>();
+            slot.backprop = [this, node, &slot] { backprop(node, slot); };
+            order_.push_back(&slot);
+        }
+        return needed;
+    }
+
+    // constants need no gradient
+    template <IsNode Node>
+        requires(!Node::requires_grad)
+    bool visit(const std::shared_ptr<Node>) {
+        return false;
+    }
+
+    // the edge to an input that has been visited
+    template <IsNode Node>
+    Edge edge_to(const std::shared_ptr<Node>& node) {
+        if constexpr (Node::requires_grad) {
+            if (node) {
+                Slot& slot = slots_.at(node.get());
+                if (slot.needed) return {&slot};
+            }
+        }
+        return {};
+    }
+
+    // Rank the gradients each node receives in the order a single thread delivers them.
+    void rank_edges() {
+        for (auto it = order_.rbegin(); it != order_.rend(); it++) {
+            for (Edge& edge : (*it)->edges_out) {
+                if (edge.slot) edge.rank = edge.slot->edges++;
+            }
+        }
+    }
+
+    template <IsShape Shape, Number DType>
+    void add_grad(Slot& slot, std::size_t rank, const Tensor<Shape, DType>& gradient) {
+        {
+            std::lock_guard lock{slot.mutex};
+            if (rank != slot.summed) {
+                // waits for the gradients ranked before it
+                if (slot.early.empty()) slot.early.resize(slot.edges);
+                slot.early[rank] = gradient.get_data();
+                return;
+            }
+            sum_grad<Shape, DType>(slot, gradient.get_data());
+            while (slot.summed < slot.early.size() && slot.early[slot.summed]) {
+                sum_grad<Shape, DType>(slot, std::move(slot.early[slot.summed]));
+            }
+            if (slot.summed < slot.edges) return;
+        }
+        make_ready(slot);
+    }
+
+    template <typename Gradient>
+    void add_grad(const Edge& edge, const Gradient& gradient) {
+        if constexpr (!std::is_same_v<Gradient, NoGrad>) {
+            if (edge.slot) add_grad(*edge.slot, edge.rank, gradient);
+        }
+    }
+
+    // add the next gradient to the sum
+    template <IsShape Shape, Number DType>
+    void sum_grad(Slot& slot, std::shared_ptr<void> gradient) {
+        using Storage = typename Tensor<Shape, DType>::Storage;
+        slot.summed++;
+        if (!slot.gradient) {
+            slot.gradient = std::move(gradient);
+            return;
+        }
+
+        auto sum_data = std::static_pointer_cast<Storage>(slot.gradient)->data();
+        auto gradient_data = std::static_pointer_cast<const Storage>(gradient)->data();
+        if (slot.owned) {
+            kernel::elementwise<Shape::flat_size>([=](Size i) { sum_data[i] += gradient_data[i]; });
+        } else {
+            // the first gradient may be shared with other tensors, so the sum goes to a new buffer
+            Tensor<Shape, DType> sum{uninitialized};
+            auto result_data = sum._flat_data().data();
+            kernel::elementwise<Shape::flat_size>(
+                [=](Size i) { result_data[i] = sum_data[i] + gradient_data[i]; });
+            slot.gradient = sum.get_data();
+            slot.owned = true;
+        }
+    }
+
+    // A node's gradient is complete. A sequential pass gets to it in order_; a parallel one runs it as a task if it is
+    // small and others are running, and queues it otherwise.
+    void make_ready(Slot& slot) {
+        if (!parallel_) return;
+        if (in_tasks_ && slot.alongside) {
+            spawn(&slot);
+            return;
+        }
+        std::lock_guard lock{ready_mutex_};
+        ready_.push_back(&slot);
+    }
+
+    void run_parallel() {
+        while (!ready_.empty()) {
+            if (std::count_if(ready_.begin(), ready_.end(), [](const Slot* slot) { return slot->alongside; }) > 1) {
+                run_tasks();
+                continue;
+            }
+            // one node at a time, in sequential order
+            auto it = std::max_element(ready_.begin(), ready_.end(),
+                                       [](const Slot* a, const Slot* b) { return a->position < b->position; });
+            Slot* slot = *it;
+            ready_.erase(it);
+            slot->backprop();
+        }
+    }
+
+    // Run the small ready nodes as tasks, along with the small nodes they make ready in turn. The larger nodes they
+    // make ready wait in ready_.
+    void run_tasks() {
+        auto large =
+            std::stable_partition(ready_.begin(), ready_.end(), [](const Slot* slot) { return slot->alongside; });
+        std::vector<Slot*> small(ready_.begin(), large);
+        ready_.erase(ready_.begin(), large);
+
+        in_tasks_ = true;
+#pragma omp parallel
+#pragma omp single
+        for (Slot* slot : small) spawn(slot);
+        in_tasks_ = false;
+
+        if (error_) std::rethrow_exception(error_);
+    }
+
+    void spawn(Slot* slot) {
+#pragma omp task firstprivate(slot)
+        {
+            // the task may run on another thread, which has grad mode of its own
+            _GradModeGuard grad_mode{grad_enabled_};
+            try {
+                slot->backprop();
+            } catch (...) {
+                std::lock_guard lock{ready_mutex_};
+                if (!error_) error_ = std::current_exception();
+            }
+        }
+    }
+
+    template <IsNode Node>
+    void backprop(const std::shared_ptr<Node> node, Slot& slot) {
+        using OutTensor = Tensor<typename Node::OutShape, typename Node::DType>;
+        const OutTensor d_loss_d_out{std::static_pointer_cast<typename OutTensor::Storage>(slot.gradient)};
+        slot.gradient.reset();
+
+        std::apply([&](auto&... grad_holders) { (accumulate_grad(node, d_loss_d_out, grad_holders), ...); },
+                   grad_holders_);
+
+        if constexpr (IsUnaryNode<Node>) {
+            add_grad(slot.edges_out[0], node->grad_fn(d_loss_d_out));
+        } else if constexpr (IsBinaryNode<Node>) {
+            auto [d_loss_d_in1, d_loss_d_in2] = node->grad_fn(d_loss_d_out);
+            add_grad(slot.edges_out[0], d_loss_d_in1);
+            add_grad(slot.edges_out[1], d_loss_d_in2);
+        } else if constexpr (IsFusedNode<Node>) {
+            auto d_loss_d_ins = node->grad_fn(d_loss_d_out);
+            [&]<std::size_t... Is>(std::index_sequence<Is...>) {
+                (add_grad(slot.edges_out[Is], std::get<Is>(d_loss_d_ins)), ...);
+            }(std::make_index_sequence<std::tuple_size_v<decltype(d_loss_d_ins)>>{});
+        } else if constexpr (IsCheckpointNode<Node>) {
+            backprop_checkpoint(node, slot, d_loss_d_out);
+        }
+    }
+
+    // Run a checkpointed segment again, recording its graph this time, from leaves that stand in for its inputs. A
+    // nested pass takes d_loss_d_out through it, to those leaves and to any of our parameters the segment uses.
+    template <IsCheckpointNode Node>
+    void backprop_checkpoint(const std::shared_ptr<Node> node, const Slot& slot,
+                             const Tensor<typename Node::OutShape, typename Node::DType>& d_loss_d_out) {
+        _GradModeGuard grad_mode{true};
+        [&]<std::size_t... Is>(std::index_sequence<Is...>) {
+            auto leaves = std::make_tuple(_checkpoint_leaf(std::get<Is>(node->inputs))...);
+            auto out = node->fn(std::get<Is>(leaves)...);
+
+            // one holder per leaf that requires a gradient
+            auto leaf_holders = std::tuple_cat(_checkpoint_holder(std::get<Is>(leaves))...);
+            std::apply(
+                [&](auto&... leaf_holders) {
+                    std::apply(
+                        [&](auto&... grad_holders) {
+                            vgrad::_BackwardPass{leaf_holders..., grad_holders...}.run(out.get_node(), d_loss_d_out);
+                        },
+                        grad_holders_);
+                },
+                leaf_holders);
+
+            // the gradients of the leaves are those of the inputs
+            ([&] {
+                if constexpr (Node::input_requires_grad[Is]) {
+                    constexpr std::size_t holder = [] {
+                        std::size_t k = 0;
+                        for (std::size_t i = 0; i < Is; i++) k += Node::input_requires_grad[i];
+                        return k;
+                    }();
+                    add_grad(slot.edges_out[Is], std::get<holder>(leaf_holders).gradient());
+                }
+            }(),
+             ...);
+        }(std::make_index_sequence<Node::input_requires_grad.size()>{});
+    }
+};
+
+// The gradients of out with respect to params. A gradient that reaches a tensor by a single path is returned in the
+// buffer it arrived in, so gradients may share storage with each other.
 template <IsScalarTensor RootTensor, IsTensor... Params>
-    requires IsFloatTensor<RootTensor> && (IsFloatTensor<Params> && ...)
+    requires IsFloatTensor<RootTensor> && (IsFloatTensor<Params> && ...) && (Params::requires_grad && ...)
 auto backward(const RootTensor& out, const Params&... params) {
     PROFILE_SCOPE("backward");
     auto grad_holders = std::make_tuple(GradientHolder{params}...);
-    std::apply([&](auto&... grad_holders) { backward_rec(out.get_node(), ones_like(out), grad_holders...); },
-               grad_holders);
-    return std::apply([](auto&... grad_holders) { return std::make_tuple(grad_holders.gradient...); }, grad_holders);
+    std::apply(
+        [&](auto&... grad_holders) { _BackwardPass<Params...>{grad_holders...}.run(out.get_node(), ones_like(out)); },
+        grad_holders);
+    return std::apply([](auto&... grad_holders) { return std::make_tuple(grad_holders.gradient()...); },
+                      grad_holders);
+}
+
+template <IsScalarTensor RootTensor, IsTensor... Params>
+void _backward_into(const RootTensor& out, const std::tuple<typename Params::Contiguous...>& grads, bool accumulate,
+                    const Params&... params) {
+    auto grad_holders = std::apply(
+        [&](const auto&... grads) { return std::make_tuple(GradientHolder<Params>{params, grads, accumulate}...); },
+        grads);
+    std::apply(
+        [&](auto&... grad_holders) {
+            _BackwardPass<Params...>{grad_holders...}.run(out.get_node(), ones_like(out));
+            // zeroes the buffers no gradient reached
+            (grad_holders.gradient(), ...);
+        },
+        grad_holders);
+}
+
+// Same as backward(), but adds the gradients to the given tensors instead of returning new ones.
+template <IsScalarTensor RootTensor, IsTensor... Params>
+    requires IsFloatTensor<RootTensor> && (IsFloatTensor<Params> && ...) && (Params::requires_grad && ...)
+void backward_into(const RootTensor& out, const std::tuple<typename Params::Contiguous...>& grads,
+                   const Params&... params) {
+    PROFILE_SCOPE("backward_into");
+    _backward_into(out, grads, true, params...);
+}
+
+// Same as backward(), but writes the gradients into the given tensors, replacing what they hold. Nothing is zeroed
+// first: the first gradient to reach a tensor is copied in, and later ones are added to it.
+template <IsScalarTensor RootTensor, IsTensor... Params>
+    requires IsFloatTensor<RootTensor> && (IsFloatTensor<Params> && ...) && (Params::requires_grad && ...)
+void backward_to(const RootTensor& out, const std::tuple<typename Params::Contiguous...>& grads,
+                 const Params&... params) {
+    PROFILE_SCOPE("backward_to");
+    _backward_into(out, grads, false, params...);
 }
 
 }  // namespace vgrad
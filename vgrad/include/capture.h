@@ -0,0 +1,118 @@
+#ifndef VGRAD_CAPTURE_H_
+#define VGRAD_CAPTURE_H_
+
+#include <functional>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "profile.h"
+
+namespace vgrad {
+
+// What a capture records: every kernel run while it is active, in order, and every buffer allocated meanwhile.
+struct _Capture {
+    std::vector<std::function<void()>> kernels;
+    std::vector<std::shared_ptr<const void>> buffers;
+};
+
+inline thread_local _Capture* _current_capture = nullptr;
+
+// Sets the capture that kernels on this thread are recorded into, for as long as it is alive.
+class _CaptureGuard {
+   public:
+    explicit _CaptureGuard(_Capture* capture) : previous_{_current_capture} { _current_capture = capture; }
+    ~_CaptureGuard() { _current_capture = previous_; }
+
+    _CaptureGuard(const _CaptureGuard&) = delete;
+    _CaptureGuard& operator=(const _CaptureGuard&) = delete;
+
+   private:
+    _Capture* const previous_;
+};
+
+// Run kernel now, and add it to the active capture, if any. A replay runs it again after the op that launched it has
+// returned, so it must hold by value everything it uses (raw pointers into tensor buffers are fine: the capture keeps
+// the buffers). Kernels it launches itself are part of it, and aren't recorded separately.
+template <typename Kernel>
+void _record(Kernel kernel) {
+    _Capture* capture = _current_capture;
+    if (!capture) {
+        kernel();
+        return;
+    }
+    {
+        _CaptureGuard inner{nullptr};
+        kernel();
+    }
+    capture->kernels.emplace_back(std::move(kernel));
+}
+
+// Keep a buffer allocated during a capture for as long as the capture.
+template <typename T>
+std::shared_ptr<T> _retain(std::shared_ptr<T> buffer) {
+    if (_current_capture) _current_capture->buffers.push_back(buffer);
+    return buffer;
+}
+
+// Records a step (e.g. a forward pass, backward() and an optimizer update) the first time it runs, and replays it
+// every time after. A replay runs the recorded kernels again, in order, on the buffers they used the first time: no
+// graph is built, no grad_fn is called, and nothing is allocated (the scratch some kernels use, e.g. the packing
+// buffers of matmul, is kept per thread from the first run). Shapes are fixed at compile time, so only the data changes
+// from one step to the next.
+//
+// The step must run the same kernels every time: no branching on tensor values, which a replay doesn't read again. It
+// reads its inputs from the same buffers on every replay, so new inputs are copied into those buffers in place.
+// Tensors and optimizers created outside the step must outlive it, and tensors must keep their buffers (operator-=
+// replaces them, and throws during a capture). Every buffer the step allocates is kept, so a captured step holds its
+// whole forward and backward pass in memory, outside any arena.
+//
+//   CapturedStep train_step{[&] {
+//       auto loss = cross_entropy(model(x), labels);
+//       optimizer.step(loss);
+//       return loss;
+//   }};
+//   for (...) std::cout << train_step().value();
+template <typename Fn>
+    requires(!std::is_void_v<std::invoke_result_t<Fn&>>)
+class CapturedStep {
+   public:
+    using Result = std::invoke_result_t<Fn&>;
+
+    explicit CapturedStep(Fn fn) : fn_{std::move(fn)} {}
+
+    CapturedStep(const CapturedStep&) = delete;
+    CapturedStep& operator=(const CapturedStep&) = delete;
+
+    // Run the step, capturing it the first time and replaying it after. Each replay rewrites the result's buffers.
+    const Result& operator()() {
+        if (!result_) {
+            PROFILE_SCOPE("CapturedStep::capture");
+            _CaptureGuard guard{&capture_};
+            try {
+                result_.emplace(fn_());
+            } catch (...) {
+                capture_ = {};
+                throw;
+            }
+        } else {
+            // no PROFILE_SCOPE here: every scope adds a node to the profile, which would allocate on every replay
+            for (const auto& kernel : capture_.kernels) kernel();
+        }
+        return *result_;
+    }
+
+    bool captured() const { return result_.has_value(); }
+    std::size_t kernel_count() const { return capture_.kernels.size(); }
+
+   private:
+    Fn fn_;
+    _Capture capture_;
+    std::optional<Result> result_;
+};
+
+}  // namespace vgrad
+
+#endif  // VGRAD_CAPTURE_H_
@@ -0,0 +1,39 @@
+#ifndef VGRAD_CHECKPOINT_H_
+#define VGRAD_CHECKPOINT_H_
+
+#include <concepts>
+#include <tuple>
+#include <type_traits>
+
+#include "grad_mode.h"
+#include "graph.h"
+
+namespace vgrad {
+
+// Compute fn(inputs...) without keeping the activations inside it. Between the forward pass and backward(), only the
+// inputs and the result stay alive; backward() runs fn again to differentiate through it, trading that compute for the
+// memory. fn must give the same result when run again. Besides the inputs, parameters that fn uses directly (e.g. the
+// weights of a module) get their gradients too.
+//
+//   auto h = checkpoint([&](const auto& x) { return relu(layer1(x)); }, x);
+template <typename Fn, IsTensor... Inputs>
+    requires(sizeof...(Inputs) > 0) && std::invocable<const Fn&, const Inputs&...> &&
+            IsTensor<std::invoke_result_t<const Fn&, const Inputs&...>>
+auto checkpoint(const Fn& fn, const Inputs&... inputs) {
+    PROFILE_SCOPE("checkpoint");
+    using Node = CheckpointNode<Fn, Inputs...>;
+    using Result = typename Node::Result;
+
+    const Result result = [&] {
+        NoGradGuard no_grad;
+        return fn(inputs...);
+    }();
+
+    return Tensor<typename Result::Shape, typename Result::DType, Node, typename Result::Layout>{
+        result.get_data(), Node{std::make_tuple(inputs...), fn}}
+        .bind_profile(PROFILE_NODE);
+}
+
+}  // namespace vgrad
+
+#endif  // VGRAD_CHECKPOINT_H_
@@ -309,6 +309,18 @@ constexpr auto add_complexities(Cx1, Cx2) {
 template <IsComplexity Cx1, IsComplexity Cx2>
 using AddComplexities = decltype(add_complexities(Cx1{}, Cx2{}));
 
+template <IsComplexity Cx, IsComplexity... Rest>
+constexpr auto sum_complexities(Cx, Rest... rest) {
+    if constexpr (sizeof...(Rest) == 0) {
+        return Cx{};
+    } else {
+        return add_complexities(Cx{}, sum_complexities(rest...));
+    }
+}
+
+template <IsComplexity Cx, IsComplexity... Rest>
+using SumComplexities = decltype(sum_complexities(Cx{}, Rest{}...));
+
 template <IsComplexity Cx, IsConstant Bound>
     requires CanAddConstants<typename Cx::Total, Bound>
 struct UpperBoundCheck {
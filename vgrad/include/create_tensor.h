@@ -3,6 +3,7 @@
 
 #include <random>
 
+#include "elementwise.h"
 #include "tensor.h"
 
 namespace vgrad {
@@ -24,8 +25,9 @@ constexpr auto eye() {
 template <typename DType, IsShape Shape>
 constexpr auto full(DType value) {
     PROFILE_SCOPE("full");
-    Tensor<Shape, DType> result;
-    result._flat_data().fill(value);
+    Tensor<Shape, DType> result{uninitialized};
+    auto result_data = result._flat_data().data();
+    kernel::elementwise<Shape::flat_size>([=](Size i) { result_data[i] = value; });
     return result;
 }
 
@@ -46,7 +48,7 @@ constexpr auto arange() {
     PROFILE_SCOPE("arange");
     Dim dim;
     auto shape = make_shape(dim);
-    Tensor<decltype(shape), DType> result;
+    Tensor<decltype(shape), DType> result{uninitialized};
     for (Size i = 0; i < Dim::value; i++) {
         result._flat_data()[i] = i;
     }
@@ -58,10 +60,12 @@ auto randn() {
     PROFILE_SCOPE("randn");
     std::normal_distribution<DType> dist(0, 1);
 
-    Tensor<Shape, DType> result;
-    for (Size i = 0; i < Shape::flat_size; i++) {
-        result._flat_data()[i] = dist(eng);
-    }
+    Tensor<Shape, DType> result{uninitialized};
+    // a captured step draws new numbers on every replay
+    auto result_data = result._flat_data().data();
+    _record([=]() mutable {
+        for (Size i = 0; i < Shape::flat_size; i++) result_data[i] = dist(eng);
+    });
     return result;
 }
 
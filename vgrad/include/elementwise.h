@@ -0,0 +1,181 @@
+#ifndef VGRAD_ELEMENTWISE_H_
+#define VGRAD_ELEMENTWISE_H_
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <type_traits>
+
+#include "capture.h"
+#include "types.h"
+
+// Element-wise loops over at most this many elements run on the calling thread; longer ones are split into chunks of
+// this many elements and shared across the OpenMP team. Define before including vgrad.h to tune.
+#ifndef VGRAD_GRAIN_SIZE
+#define VGRAD_GRAIN_SIZE 32768
+#endif
+
+namespace vgrad::kernel {
+
+inline constexpr Size grain_size = VGRAD_GRAIN_SIZE;
+
+// Uninitialized scratch memory for a kernel, for as long as the Scratch lives. It comes from buffers that the calling
+// thread keeps for T: each grows to the largest size asked of it and is then reused, so once a training loop has
+// warmed up, its kernels don't allocate. Scratches alive at once on a thread (e.g. both packing buffers of a GEMM) each
+// hold a buffer of their own, and always the same one, since they are taken in the same order every time.
+template <typename T>
+class Scratch {
+   public:
+    explicit Scratch(std::size_t n) {
+        auto& buffers = thread_buffers();
+        auto it = std::find_if(buffers.begin(), buffers.end(), [](const Buffer& buffer) { return !buffer.in_use; });
+        buffer_ = it != buffers.end() ? &*it : &buffers.emplace_back();
+        buffer_->in_use = true;
+        if (buffer_->size < n) {
+            buffer_->data = std::make_unique_for_overwrite<T[]>(n);
+            buffer_->size = n;
+        }
+    }
+
+    ~Scratch() { buffer_->in_use = false; }
+
+    Scratch(const Scratch&) = delete;
+    Scratch& operator=(const Scratch&) = delete;
+
+    T* data() const { return buffer_->data.get(); }
+
+   private:
+    struct Buffer {
+        std::unique_ptr<T[]> data;
+        std::size_t size = 0;
+        bool in_use = false;
+    };
+
+    // a deque, so that taking a new buffer leaves the ones in use where they are
+    static std::deque<Buffer>& thread_buffers() {
+        thread_local std::deque<Buffer> buffers;
+        return buffers;
+    }
+
+    Buffer* buffer_;
+};
+
+template <typename Body>
+void _elementwise_chunk(Size begin, Size end, const Body& body) {
+#pragma omp simd
+    for (Size i = begin; i < end; i++) {
+        body(i);
+    }
+}
+
+// Call chunk(begin, end) for chunks of grain_size elements covering [0, Count), across the OpenMP team.
+template <Size Count, typename Chunk>
+void _for_chunks(const Chunk& chunk) {
+    if constexpr (Count <= grain_size) {
+        chunk(0, Count);
+    } else {
+        constexpr Size chunks = (Count + grain_size - 1) / grain_size;
+
+#pragma omp parallel for schedule(static)
+        for (Size c = 0; c < chunks; c++) {
+            const Size begin = c * grain_size;
+            chunk(begin, std::min(begin + grain_size, Count));
+        }
+    }
+}
+
+template <Size Count, typename Body>
+void _elementwise(const Body& body) {
+    _for_chunks<Count>([&](Size begin, Size end) { _elementwise_chunk(begin, end, body); });
+}
+
+// Call body(i) for every i in [0, Count). Iterations must be independent: each chunk is vectorized, and chunks run on
+// different threads. Since Count is known at compile time, small tensors never fork a thread team.
+template <Size Count, typename Body>
+void elementwise(Body body) {
+    _record([body = std::move(body)] { _elementwise<Count>(body); });
+}
+
+// Passed where a predicate for elementwise_rare() is expected: no element is rare.
+struct NoRareCase {};
+
+template <Size Count, typename Rare, typename Body>
+void _elementwise_rare(const Rare& rare, const Body& body) {
+    _for_chunks<Count>([&](Size begin, Size end) {
+        int any = 0;
+#pragma omp simd reduction(| : any)
+        for (Size i = begin; i < end; i++) {
+            any |= rare(i);
+        }
+
+        if (any) {
+            _elementwise_chunk(begin, end, [&](Size i) { body(i, std::true_type{}); });
+        } else {
+            _elementwise_chunk(begin, end, [&](Size i) { body(i, std::false_type{}); });
+        }
+    });
+}
+
+// Like elementwise(), for bodies with a fast path that is wrong for a few rare elements. Each chunk first checks
+// rare(i) over all its elements, in one cheap vectorized pass, then calls body(i, std::true_type{}) throughout if any
+// is rare, and body(i, std::false_type{}) otherwise. Chunks without a rare element never run the slow path.
+template <Size Count, typename Rare, typename Body>
+void elementwise_rare(Rare rare, Body body) {
+    _record([rare = std::move(rare), body = std::move(body)] { _elementwise_rare<Count>(rare, body); });
+}
+
+template <Size Rows, Size Cols, Number DType, typename Term>
+void _column_sums(DType* out, const Term& term) {
+    if constexpr (Rows * Cols <= grain_size || Cols >= grain_size) {
+        constexpr Size col_chunks = (Cols + grain_size - 1) / grain_size;
+
+#pragma omp parallel for schedule(static) if (col_chunks > 1)
+        for (Size chunk = 0; chunk < col_chunks; chunk++) {
+            const Size begin = chunk * grain_size;
+            const Size end = std::min(begin + grain_size, Cols);
+            std::fill(out + begin, out + end, DType{0});
+            for (Size k = 0; k < Rows; k++) {
+#pragma omp simd
+                for (Size j = begin; j < end; j++) out[j] += term(k * Cols + j);
+            }
+        }
+    } else {
+        constexpr Size rows_per_chunk = grain_size / Cols;
+        constexpr Size row_chunks = (Rows + rows_per_chunk - 1) / rows_per_chunk;
+        Scratch<DType> partials{row_chunks * Cols};
+
+#pragma omp parallel for schedule(static)
+        for (Size chunk = 0; chunk < row_chunks; chunk++) {
+            DType* partial = partials.data() + chunk * Cols;
+            std::fill(partial, partial + Cols, DType{0});
+            const Size end = std::min((chunk + 1) * rows_per_chunk, Rows);
+            for (Size k = chunk * rows_per_chunk; k < end; k++) {
+#pragma omp simd
+                for (Size j = 0; j < Cols; j++) partial[j] += term(k * Cols + j);
+            }
+        }
+
+        std::fill(out, out + Cols, DType{0});
+        for (Size chunk = 0; chunk < row_chunks; chunk++) {
+#pragma omp simd
+            for (Size j = 0; j < Cols; j++) out[j] += partials.data()[chunk * Cols + j];
+        }
+    }
+}
+
+// out[j] = sum over k in [0, Rows) of term(k * Cols + j), for every j in [0, Cols). This is the gradient of an operand
+// that was broadcast over Rows leading rows, computed without materializing the Rows x Cols terms. Wide rows are
+// split across threads by column; narrow rows by row, each chunk summing into its own partial row. The chunking only
+// depends on Rows and Cols, so results don't vary with the thread count.
+template <Size Rows, Size Cols, Number DType, typename Term>
+void column_sums(DType* out, Term term) {
+    _record([out, term = std::move(term)] { _column_sums<Rows, Cols>(out, term); });
+}
+
+}  // namespace vgrad::kernel
+
+#endif  // VGRAD_ELEMENTWISE_H_
@@ -0,0 +1,287 @@
+#ifndef VGRAD_EXPR_H_
+#define VGRAD_EXPR_H_
+
+#include <tuple>
+#include <utility>
+
+#include "elementwise.h"
+#include "forward.h"
+#include "graph.h"
+#include "tensor.h"
+
+// Lazy element-wise expressions. Applied to an expression (see lazy()), the element-wise ops build a node of an
+// expression tree instead of computing a tensor, and materialize() evaluates the whole tree in a single loop: one pass
+// over the inputs and one output buffer, where the same ops applied eagerly would each write a tensor and add a graph
+// node. The backward pass is fused the same way, computing the gradients of all the inputs in one pass.
+//
+//   auto w2 = materialize(lazy(w) - lr * lazy(m) / (sqrt(lazy(v)) + eps));
+
+namespace vgrad {
+
+template <typename T>
+concept IsExpr = requires {
+    { T::is_expr } -> std::same_as<const bool&>;
+} && T::is_expr;
+
+// the element-wise ops take tensors and expressions alike
+template <typename T>
+concept IsOperand = IsTensor<T> || IsExpr<T>;
+
+template <typename T>
+concept IsFloatOperand = IsOperand<T> && std::is_floating_point_v<typename T::DType>;
+
+// Storage index of the element of a that lines up with flat index i of a broadcast result of OutSize elements. A
+// broadcast operand repeats every A::Shape::flat_size elements.
+template <IsTensor A, Size OutSize>
+constexpr Size _broadcast_index(Size i) {
+    if constexpr (A::Shape::flat_size == OutSize) {
+        return A::Layout::storage_index(i);
+    } else {
+        return A::Layout::storage_index(i % A::Shape::flat_size);
+    }
+}
+
+// Every node of a tree is evaluated at flat index i of the root, which has OutSize elements; broadcasting only repeats
+// trailing axes, so leaves line up by _broadcast_index() however deep they are. value() computes the element, and
+// eval() also writes its derivatives with respect to each leaf of the subtree to partials[0, leaf_count).
+template <IsTensor T>
+struct LeafExpr {
+    static constexpr bool is_expr = true;
+    static constexpr Size leaf_count = 1;
+
+    using Shape = typename T::Shape;
+    using DType = typename T::DType;
+
+    T tensor;
+    const DType* data;
+
+    explicit LeafExpr(const T& tensor) : tensor{tensor}, data{tensor.storage_view().data()} {}
+
+    template <Size OutSize>
+    DType value(Size i) const {
+        return data[_broadcast_index<T, OutSize>(i)];
+    }
+
+    template <Size OutSize>
+    DType eval(Size i, DType* partials) const {
+        partials[0] = 1;
+        return value<OutSize>(i);
+    }
+
+    auto leaves() const { return std::make_tuple(tensor); }
+
+    // the same expression over detached tensors, which don't hold on to the graph
+    auto detach() const { return LeafExpr<typename T::Detached>{tensor.detach()}; }
+};
+
+template <IsExpr A, typename Forward, typename Backward>
+struct UnaryExpr {
+    static constexpr bool is_expr = true;
+    static constexpr Size leaf_count = A::leaf_count;
+
+    using Shape = typename A::Shape;
+    using DType = typename A::DType;
+
+    A a;
+    Forward forward;
+    Backward backward;
+
+    template <Size OutSize>
+    DType value(Size i) const {
+        return forward(a.template value<OutSize>(i));
+    }
+
+    template <Size OutSize>
+    DType eval(Size i, DType* partials) const {
+        const DType x = a.template eval<OutSize>(i, partials);
+        const DType y = forward(x);
+        const DType d = backward(x, y);
+        for (Size k = 0; k < leaf_count; k++) partials[k] *= d;
+        return y;
+    }
+
+    auto leaves() const { return a.leaves(); }
+
+    auto detach() const {
+        using Detached = UnaryExpr<decltype(a.detach()), Forward, Backward>;
+        return Detached{a.detach(), forward, backward};
+    }
+};
+
+template <IsExpr A, IsExpr B, typename Forward, typename BackwardA, typename BackwardB>
+struct BinaryExpr {
+    static constexpr bool is_expr = true;
+    static constexpr Size leaf_count = A::leaf_count + B::leaf_count;
+
+    using Shape = std::conditional_t<(A::Shape::rank >= B::Shape::rank), typename A::Shape, typename B::Shape>;
+    using DType = typename A::DType;
+
+    A a;
+    B b;
+    Forward forward;
+    BackwardA backward_a;
+    BackwardB backward_b;
+
+    template <Size OutSize>
+    DType value(Size i) const {
+        return forward(a.template value<OutSize>(i), b.template value<OutSize>(i));
+    }
+
+    template <Size OutSize>
+    DType eval(Size i, DType* partials) const {
+        const DType x = a.template eval<OutSize>(i, partials);
+        const DType y = b.template eval<OutSize>(i, partials + A::leaf_count);
+        const DType da = backward_a(x, y);
+        const DType db = backward_b(x, y);
+        for (Size k = 0; k < A::leaf_count; k++) partials[k] *= da;
+        for (Size k = A::leaf_count; k < leaf_count; k++) partials[k] *= db;
+        return forward(x, y);
+    }
+
+    auto leaves() const { return std::tuple_cat(a.leaves(), b.leaves()); }
+
+    auto detach() const {
+        using Detached = BinaryExpr<decltype(a.detach()), decltype(b.detach()), Forward, BackwardA, BackwardB>;
+        return Detached{a.detach(), b.detach(), forward, backward_a, backward_b};
+    }
+};
+
+// Start a lazy expression from a tensor.
+template <IsTensor T>
+auto lazy(const T& t) {
+    return LeafExpr<T>{t};
+}
+
+template <IsOperand A>
+auto _as_expr(const A& a) {
+    if constexpr (IsExpr<A>) {
+        return a;
+    } else {
+        return lazy(a);
+    }
+}
+
+// Overloads of the element-wise op builders in ops.h, chosen when an operand is an expression.
+template <IsExpr A>
+auto _unary_op(const A& a, auto forward, auto backward) {
+    return UnaryExpr<A, decltype(forward), decltype(backward)>{a, forward, backward};
+}
+
+template <IsOperand A, IsOperand B>
+    requires(IsExpr<A> || IsExpr<B>)
+auto _binary_op(const A& a, const B& b, auto forward, auto backward_a, auto backward_b) {
+    auto a_expr = _as_expr(a);
+    auto b_expr = _as_expr(b);
+    return BinaryExpr<decltype(a_expr), decltype(b_expr), decltype(forward), decltype(backward_a),
+                      decltype(backward_b)>{a_expr, b_expr, forward, backward_a, backward_b};
+}
+
+template <IsShape Shape, Number DType, typename Leaves>
+struct _FusedNode;
+
+template <IsShape Shape, Number DType, IsTensor... Leaves>
+struct _FusedNode<Shape, DType, std::tuple<Leaves...>> {
+    using type = FusedOpNode<Shape, DType, cx::ProductTermFromShape<Shape>, typename Leaves::Node...>;
+};
+
+template <std::size_t K, typename Tensors>
+constexpr Size _flat_size_at = std::tuple_element_t<K, Tensors>::Shape::flat_size;
+
+template <std::size_t K, typename Tensors>
+constexpr bool _requires_grad_at = std::tuple_element_t<K, Tensors>::requires_grad;
+
+// Evaluate an expression into a tensor, in one element-wise loop. The tensor gets a single graph node whose inputs are
+// the leaves of the expression; a tensor that appears more than once is a separate input each time.
+template <IsExpr E>
+auto materialize(const E& e) {
+    PROFILE_SCOPE("materialize");
+    using Shape = typename E::Shape;
+    using DType = typename E::DType;
+    using Leaves = decltype(e.leaves());
+    using Node = typename _FusedNode<Shape, DType, Leaves>::type;
+    constexpr Size size = Shape::flat_size;
+
+    Tensor<Shape, DType> raw_result{uninitialized};
+
+    auto result_data = raw_result._flat_data().data();
+    kernel::elementwise<size>([=](Size i) { result_data[i] = e.template value<size>(i); });
+
+    // forward mode: the tangents of the leaves, each scaled by its partial derivative
+    [&]<std::size_t... Ks>(std::index_sequence<Ks...>) {
+        const auto leaves = e.leaves();
+        const DType* const t_leaves[] = {_tangent(std::get<Ks>(leaves))...};
+        if (((t_leaves[Ks] != nullptr) || ...)) {
+            auto t_result = _current_tangents->emplace(raw_result);
+            const Size count = _current_tangents->count();
+            kernel::elementwise<size>([=](Size i) {
+                DType partials[E::leaf_count];
+                e.template eval<size>(i, partials);
+                for (Size k = 0; k < count; k++) {
+                    DType t = 0;
+                    ([&] {
+                        using Leaf = std::tuple_element_t<Ks, Leaves>;
+                        if (t_leaves[Ks]) {
+                            const Size index = k * Leaf::Layout::storage_size + _broadcast_index<Leaf, size>(i);
+                            t += partials[Ks] * t_leaves[Ks][index];
+                        }
+                    }(),
+                     ...);
+                    t_result[k * size + i] = t;
+                }
+            });
+        }
+    }(std::make_index_sequence<E::leaf_count>{});
+
+    return Tensor<Shape, DType, Node>{
+        raw_result.get_data(),
+        Node{
+            std::apply([](const auto&... leaves) { return std::make_tuple(leaves.get_node()...); }, e.leaves()),
+            // the leaves' nodes are the node's inputs; the copy of the expression it keeps for the backward pass
+            // holds detached tensors, so as not to keep the graph alive a second time
+            [e = e.detach()](const auto& dl_df) {
+                PROFILE_SCOPE("materialize::grad");
+                auto dl_dleaves = _uninitialized_grads<typename Node::InGrads>();
+
+                auto dl_df_data = dl_df.flat_view().data();
+                [&]<std::size_t... Ks>(std::index_sequence<Ks...>) {
+                    DType* const dl_dleaf_data[] = {_grad_data<DType>(std::get<Ks>(dl_dleaves))...};
+
+                    // leaves the size of the result get their gradients together, in one pass; leaves that don't
+                    // require a gradient get none
+                    if constexpr (((_requires_grad_at<Ks, Leaves> && _flat_size_at<Ks, Leaves> == size) || ...)) {
+                        kernel::elementwise<size>([=](Size i) {
+                            DType partials[E::leaf_count];
+                            e.template eval<size>(i, partials);
+                            ([&] {
+                                if constexpr (_requires_grad_at<Ks, Leaves> && _flat_size_at<Ks, Leaves> == size) {
+                                    dl_dleaf_data[Ks][i] = dl_df_data[i] * partials[Ks];
+                                }
+                            }(),
+                             ...);
+                        });
+                    }
+
+                    // broadcast leaves sum over the rows they were repeated across
+                    ([&] {
+                        if constexpr (_requires_grad_at<Ks, Leaves> && _flat_size_at<Ks, Leaves> != size) {
+                            constexpr Size cols = _flat_size_at<Ks, Leaves>;
+                            kernel::column_sums<size / cols, cols>(dl_dleaf_data[Ks], [=](Size i) {
+                                DType partials[E::leaf_count];
+                                e.template eval<size>(i, partials);
+                                return dl_df_data[i] * partials[Ks];
+                            });
+                        }
+                    }(),
+                     ...);
+                }(std::make_index_sequence<E::leaf_count>{});
+
+                return dl_dleaves;
+            },
+        },
+    }
+        .bind_profile(PROFILE_NODE);
+}
+
+}  // namespace vgrad
+
+#endif  // VGRAD_EXPR_H_
@@ -0,0 +1,145 @@
+#ifndef VGRAD_FLAT_PARAMS_H_
+#define VGRAD_FLAT_PARAMS_H_
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <memory>
+#include <tuple>
+#include <utility>
+
+#include "backward.h"
+#include "elementwise.h"
+#include "forward.h"
+#include "micro_batch.h"
+
+namespace vgrad {
+
+constexpr Size _round_up(Size n, Size multiple) { return (n + multiple - 1) / multiple * multiple; }
+
+// leaves (contiguous, with no graph behind them) of a single dtype
+template <typename... Params>
+concept IsFlattenable =
+    (sizeof...(Params) > 0) && (IsTensor<Params> && ...) &&
+    ((IsLeafNode<typename Params::Node> && Params::Layout::is_contiguous) && ...) &&
+    (std::is_same_v<typename Params::DType, typename std::tuple_element_t<0, std::tuple<Params...>>::DType> && ...);
+
+// Keeps a set of parameters back to back in one buffer, with their gradients in a second buffer laid out the same
+// way. Each parameter is rebound to a view into the buffer (its values are kept), so code that works a tensor at a
+// time still works, while whole-set operations (optimizer steps, zeroing or measuring the gradients, copying the
+// parameters out) run as a single loop over the buffer. Each tensor starts on a 64-byte boundary; the padding between
+// them stays zero.
+//
+//   FlatParams params{model.params()};
+//   optim::Adam optimizer{lr, params};
+template <IsTensor... Params>
+    requires IsFlattenable<Params...>
+class FlatParams {
+   public:
+    using DType = std::tuple_element_t<0, std::tuple<typename Params::DType...>>;
+
+   private:
+    static constexpr Size align = std::max<Size>(64 / sizeof(DType), 1);
+
+    static constexpr std::array<Size, sizeof...(Params)> sizes{Params::Shape::flat_size...};
+    static constexpr std::array<Size, sizeof...(Params)> offsets = [] {
+        std::array<Size, sizeof...(Params)> result{};
+        for (Size i = 1; i < sizeof...(Params); i++) result[i] = _round_up(result[i - 1] + sizes[i - 1], align);
+        return result;
+    }();
+
+   public:
+    // elements in each buffer, padding included
+    static constexpr Size size = _round_up(offsets.back() + sizes.back(), align);
+
+    struct alignas(64) Buffer {
+        std::array<DType, size> data{};
+    };
+
+    FlatParams(Params&... params) : FlatParams(std::make_tuple(std::ref(params)...)) {}
+
+    FlatParams(std::tuple<Params&...> params)
+        : params_{params}, data_{make_buffer()}, grad_data_{make_buffer()}, grads_{views(grad_data_)} {
+        PROFILE_SCOPE("FlatParams");
+        auto param_views = views(data_);
+        [&]<std::size_t... Is>(std::index_sequence<Is...>) {
+            ((std::copy_n(std::get<Is>(params_).flat_view().data(), sizes[Is], data_->data.data() + offsets[Is]),
+              std::get<Is>(params_) = Params{std::get<Is>(param_views).get_data()}),
+             ...);
+        }(std::index_sequence_for<Params...>{});
+    }
+
+    // A new zero-filled buffer laid out like the parameters, e.g. for optimizer state.
+    static std::shared_ptr<Buffer> make_buffer() { return std::make_shared<Buffer>(); }
+
+    // Tensors viewing the pieces of a buffer that line up with each parameter.
+    static auto views(const std::shared_ptr<Buffer>& buffer) {
+        return [&]<std::size_t... Is>(std::index_sequence<Is...>) {
+            return std::make_tuple(typename Params::Contiguous{std::shared_ptr<typename Params::Storage>(
+                buffer, reinterpret_cast<typename Params::Storage*>(buffer->data.data() + offsets[Is]))}...);
+        }(std::index_sequence_for<Params...>{});
+    }
+
+    const std::tuple<Params&...>& params() const { return params_; }
+    const std::tuple<typename Params::Contiguous...>& grads() const { return grads_; }
+
+    DType* data() { return data_->data.data(); }
+    DType* grad_data() { return grad_data_->data.data(); }
+
+    void zero_grad() {
+        PROFILE_SCOPE("FlatParams::zero_grad");
+        auto g = grad_data();
+        kernel::elementwise<size>([=](Size i) { g[i] = 0; });
+    }
+
+    // Compute the gradients of loss with respect to all the parameters into the gradient buffer, replacing the last
+    // ones. The buffer isn't zeroed first (see backward_to()).
+    template <IsScalarTensor Loss>
+        requires IsFloatTensor<Loss>
+    void backward(const Loss& loss) {
+        PROFILE_SCOPE("FlatParams::backward");
+        std::apply([&](const auto&... params) { backward_to(loss, grads_, params...); }, params_);
+    }
+
+    // The same as backward(loss_fn()), by forward mode (see forward_grad_into()). Returns the loss.
+    template <typename LossFn>
+    auto forward_grad(const LossFn& loss_fn) {
+        PROFILE_SCOPE("FlatParams::forward_grad");
+        zero_grad();
+        return std::apply([&](const auto&... params) { return forward_grad_into(loss_fn, grads_, params...); },
+                          params_);
+    }
+
+    // The same as backward() over a batch, one micro-batch at a time (see micro_batch_grad_to()). Returns the mean
+    // loss.
+    template <IsMicroBatches Batches, typename LossFn>
+    auto micro_batch_grad(const Batches& batches, const LossFn& loss_fn) {
+        PROFILE_SCOPE("FlatParams::micro_batch_grad");
+        return std::apply(
+            [&](const auto&... params) { return micro_batch_grad_to(batches, loss_fn, grads_, params...); }, params_);
+    }
+
+    // L2 norm of all the gradients together.
+    DType grad_norm() const {
+        PROFILE_SCOPE("FlatParams::grad_norm");
+        const DType* g = grad_data_->data.data();
+        double sum = 0;
+#pragma omp parallel for simd reduction(+ : sum) schedule(static) if (size > kernel::grain_size)
+        for (Size i = 0; i < size; i++) sum += static_cast<double>(g[i]) * g[i];
+        return static_cast<DType>(std::sqrt(sum));
+    }
+
+   private:
+    std::tuple<Params&...> params_;
+    std::shared_ptr<Buffer> data_;
+    std::shared_ptr<Buffer> grad_data_;
+    std::tuple<typename Params::Contiguous...> grads_;
+};
+
+}  // namespace vgrad
+
+#endif  // VGRAD_FLAT_PARAMS_H_
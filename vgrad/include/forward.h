@@ -0,0 +1,236 @@
+#ifndef VGRAD_FORWARD_H_
+#define VGRAD_FORWARD_H_
+
+#include <algorithm>
+#include <array>
+#include <concepts>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+#include "allocator.h"
+#include "capture.h"
+#include "create_tensor.h"
+#include "elementwise.h"
+#include "grad_mode.h"
+#include "tensor.h"
+
+// Forward mode. While a forward pass is active, each differentiable op computes the tangents of its result alongside
+// the result itself: the derivatives of every element along count() directions at once, with the same local
+// derivatives that its grad_fn uses in reverse mode. Tangents belong to buffers rather than to tensors, so views of a
+// buffer (transposes, broadcasts, reshapes) see its tangents through their own layout, for free. A buffer's tangents
+// are count() copies of its storage, one after the other. Only tensors that require a gradient see them, as only they
+// are reached by backward(): detach() shares the buffer, but its result is a constant, and so are views of it.
+//
+// Nothing is kept for a backward pass: a buffer's tangents are dropped soon after the buffer itself, so memory doesn't
+// grow with the length of the computation. Each op does about count() times the work, which pays off for models with
+// few parameters (see forward_grad()).
+
+namespace vgrad {
+
+class _Tangents {
+   public:
+    explicit _Tangents(Size count) : count_{count} {}
+
+    _Tangents(const _Tangents&) = delete;
+    _Tangents& operator=(const _Tangents&) = delete;
+
+    // directions computed at once
+    Size count() const { return count_; }
+
+    // the tangents of t's buffer, or nullptr if it has none or t is a constant
+    template <IsTensor T>
+    const typename T::DType* find(const T& t) {
+        if constexpr (!T::requires_grad) return nullptr;
+        auto it = entries_.find(t.get_data().get());
+        if (it == entries_.end()) return nullptr;
+        if (it->second.buffer.expired()) {
+            entries_.erase(it);
+            return nullptr;
+        }
+        return static_cast<const typename T::DType*>(it->second.tangents.get());
+    }
+
+    // new, uninitialized tangents for t's buffer, for the caller to write
+    template <IsTensor T>
+    typename T::DType* emplace(const T& t) {
+        using DType = typename T::DType;
+        if (entries_.size() >= prune_at_) prune();
+
+        auto tangents = _retain(std::allocate_shared_for_overwrite<DType[]>(CachingAllocator<DType>{},
+                                                                            count_ * T::Layout::storage_size));
+        DType* data = tangents.get();
+        entries_.insert_or_assign(t.get_data().get(), Entry{t.get_data(), std::move(tangents)});
+        return data;
+    }
+
+   private:
+    struct Entry {
+        // tangents live as long as the buffer; holding it weakly also keeps its address from being reused meanwhile
+        std::weak_ptr<const void> buffer;
+        std::shared_ptr<void> tangents;
+    };
+
+    const Size count_;
+    std::unordered_map<const void*, Entry> entries_;
+    std::size_t prune_at_ = 64;
+
+    // drop the tangents of buffers that are gone
+    void prune() {
+        std::erase_if(entries_, [](const auto& entry) { return entry.second.buffer.expired(); });
+        prune_at_ = std::max<std::size_t>(64, 2 * entries_.size());
+    }
+};
+
+inline thread_local _Tangents* _current_tangents = nullptr;
+
+// Makes ops on this thread compute tangents into a _Tangents, for as long as it is alive. Graph nodes would go unused,
+// so none are built meanwhile.
+class _ForwardGuard : NoGradGuard {
+   public:
+    explicit _ForwardGuard(_Tangents& tangents) : previous_{_current_tangents} { _current_tangents = &tangents; }
+    ~_ForwardGuard() { _current_tangents = previous_; }
+
+    _ForwardGuard(const _ForwardGuard&) = delete;
+    _ForwardGuard& operator=(const _ForwardGuard&) = delete;
+
+   private:
+    _Tangents* const previous_;
+};
+
+// The tangents of t's buffer in the current forward pass, or nullptr if there is none or t has no tangents.
+template <IsTensor T>
+const typename T::DType* _tangent(const T& t) {
+    return _current_tangents ? _current_tangents->find(t) : nullptr;
+}
+
+// Copy of direction k of t's tangents into a tensor of t's shape, or zeros if t has none.
+template <IsTensor T>
+auto _tangent_at(const T& t, Size k) {
+    typename T::Contiguous result{uninitialized};
+    auto result_data = result._flat_data().data();
+    if (auto t_data = _tangent(t)) {
+        auto t_k = t_data + k * T::Layout::storage_size;
+        kernel::elementwise<T::Shape::flat_size>([=](Size i) { result_data[i] = t_k[T::Layout::storage_index(i)]; });
+    } else {
+        kernel::elementwise<T::Shape::flat_size>([=](Size i) { result_data[i] = 0; });
+    }
+    return result;
+}
+
+// New tangents for t's buffer in the current forward pass, all zero.
+template <IsTensor T>
+typename T::DType* _zero_tangent(const T& t) {
+    auto t_data = _current_tangents->emplace(t);
+    std::fill_n(t_data, _current_tangents->count() * T::Layout::storage_size, typename T::DType{0});
+    return t_data;
+}
+
+// fn's result and its directional derivative: how the result moves as params move along tangents. fn computes the
+// result from params, which it may use directly, as a module does. Nothing is recorded for backward(), and the
+// derivative comes out of the same pass as the result.
+//
+//   auto [y, dy] = jvp([&] { return model(x); }, model.params(), directions);
+template <typename Fn, IsTensor... Params>
+    requires std::invocable<const Fn&> && IsTensor<std::invoke_result_t<const Fn&>> &&
+             ((Params::Layout::is_contiguous && std::floating_point<typename Params::DType>) && ...) &&
+             (Params::requires_grad && ...)
+auto jvp(const Fn& fn, const std::tuple<Params&...>& params,
+         const std::tuple<typename Params::Contiguous...>& tangents) {
+    PROFILE_SCOPE("jvp");
+    _Tangents context{1};
+    _ForwardGuard forward{context};
+
+    [&]<std::size_t... Is>(std::index_sequence<Is...>) {
+        ([&] {
+            using Param = std::tuple_element_t<Is, std::tuple<Params...>>;
+            auto t_data = _zero_tangent(std::get<Is>(params));
+            auto v_data = std::get<Is>(tangents).flat_view().data();
+            // recorded, so that a captured step reads the tangents again on every replay
+            _record([=] {
+                for (Size i = 0; i < Param::Shape::flat_size; i++) t_data[Param::Layout::storage_index(i)] = v_data[i];
+            });
+        }(),
+         ...);
+    }(std::index_sequence_for<Params...>{});
+
+    auto result = fn();
+    auto tangent = _tangent_at(result, 0);
+    return std::make_pair(result, tangent);
+}
+
+// The same as backward(loss, params...), by forward mode: a single pass computes the loss and its derivatives in every
+// direction of the parameters at once, one direction per parameter element. loss_fn computes the loss from params,
+// which it may use directly, as a module does. Adds the gradients to grads, and returns the loss.
+template <typename LossFn, IsTensor... Params>
+    requires std::invocable<const LossFn&> && IsScalarTensor<std::invoke_result_t<const LossFn&>> &&
+             ((Params::Layout::is_contiguous && std::floating_point<typename Params::DType>) && ...) &&
+             (Params::requires_grad && ...)
+auto forward_grad_into(const LossFn& loss_fn, const std::tuple<typename Params::Contiguous...>& grads,
+                       const Params&... params) {
+    PROFILE_SCOPE("forward_grad_into");
+    constexpr Size count = (Params::Shape::flat_size + ...);
+    _Tangents context{count};
+    _ForwardGuard forward{context};
+
+    // parameter K owns the directions from offsets[K] on
+    constexpr std::array<Size, sizeof...(Params)> offsets = [] {
+        std::array<Size, sizeof...(Params)> result{};
+        Size offset = 0;
+        Size k = 0;
+        ((result[k++] = offset, offset += Params::Shape::flat_size), ...);
+        return result;
+    }();
+
+    [&]<std::size_t... Is>(std::index_sequence<Is...>) {
+        ([&] {
+            using Param = std::tuple_element_t<Is, std::tuple<Params...>>;
+            const auto& param = std::get<Is>(std::forward_as_tuple(params...));
+            auto t_data = _zero_tangent(param);
+            for (Size i = 0; i < Param::Shape::flat_size; i++) {
+                t_data[(offsets[Is] + i) * Param::Layout::storage_size + Param::Layout::storage_index(i)] = 1;
+            }
+        }(),
+         ...);
+    }(std::index_sequence_for<Params...>{});
+
+    auto loss = loss_fn();
+    using Loss = decltype(loss);
+
+    if (auto t_loss = _tangent(loss)) {
+        constexpr Size index = Loss::Layout::storage_index(0);
+        [&]<std::size_t... Is>(std::index_sequence<Is...>) {
+            ([&] {
+                using Param = std::tuple_element_t<Is, std::tuple<Params...>>;
+                auto grad = std::get<Is>(grads);  // shares the buffer
+                auto grad_data = grad._flat_data().data();
+                auto t_param = t_loss + offsets[Is] * Loss::Layout::storage_size + index;
+                kernel::elementwise<Param::Shape::flat_size>(
+                    [=](Size i) { grad_data[i] += t_param[i * Loss::Layout::storage_size]; });
+            }(),
+             ...);
+        }(std::index_sequence_for<Params...>{});
+    }
+
+    return loss;
+}
+
+// The loss and its gradients with respect to params, computed by forward mode (see forward_grad_into()).
+//
+//   auto [loss, grads] = forward_grad([&] { return loss_fn(y, model(x)); }, w, b);
+template <typename LossFn, IsTensor... Params>
+    requires std::invocable<const LossFn&> && IsScalarTensor<std::invoke_result_t<const LossFn&>> &&
+             ((Params::Layout::is_contiguous && std::floating_point<typename Params::DType>) && ...) &&
+             (Params::requires_grad && ...)
+auto forward_grad(const LossFn& loss_fn, const Params&... params) {
+    PROFILE_SCOPE("forward_grad");
+    auto grads = std::make_tuple(zeros_like(params)...);
+    auto loss = forward_grad_into(loss_fn, grads, params...);
+    return std::make_pair(loss, grads);
+}
+
+}  // namespace vgrad
+
+#endif  // VGRAD_FORWARD_H_
@@ -0,0 +1,181 @@
+#ifndef VGRAD_GEMM_H_
+#define VGRAD_GEMM_H_
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <utility>
+
+#include "capture.h"
+#include "elementwise.h"
+#include "types.h"
+
+namespace vgrad::kernel {
+
+// widest vector register the compiler is allowed to use
+#if defined(__AVX512F__)
+inline constexpr Size simd_bytes = 64;
+#elif defined(__AVX__)
+inline constexpr Size simd_bytes = 32;
+#else
+inline constexpr Size simd_bytes = 16;  // SSE2 / NEON baseline
+#endif
+
+// Blocking follows the usual Goto/BLIS scheme: C is computed MR x NR register tiles at a time from packed
+// slivers of A (MR x KC) and B (KC x NR), so the inner loop only ever streams through contiguous memory.
+template <Number DType>
+struct GemmBlocking {
+    // register tile; 6 rows of two vectors each keeps the accumulators plus operands within 16 registers
+    static constexpr Size MR = 6;
+    static constexpr Size NR = 2 * simd_bytes / sizeof(DType);
+
+    // cache blocks; a KC x NR sliver of B stays in L1 and an MC x KC block of A stays in L2
+    static constexpr Size KC = 256;
+    static constexpr Size MC = 16 * MR;
+    static constexpr Size NC = 16 * NR;
+
+    // don't fork a thread team for products smaller than this many multiply-adds
+    static constexpr Size parallel_threshold = 1 << 16;
+};
+
+// Operands are addressed through a row stride and a column stride, so a transposed matrix is packed straight from
+// its original storage: element (i, j) of A lives at a[i * a_rs + j * a_cs].
+
+// Copy rows [0, M) x cols [k0, k0 + kc) of A into MR-row panels, zero-padding the last panel.
+template <Number DType>
+void _gemm_pack_a(Size M, Size k0, Size kc, const DType* a, Size a_rs, Size a_cs, DType* packed) {
+    using B = GemmBlocking<DType>;
+    const Size panels = (M + B::MR - 1) / B::MR;
+
+#pragma omp parallel for if (std::size_t{M} * kc >= B::parallel_threshold)
+    for (Size panel = 0; panel < panels; panel++) {
+        DType* dst = packed + panel * B::MR * kc;
+        for (Size k = 0; k < kc; k++) {
+            for (Size i = 0; i < B::MR; i++) {
+                Size row = panel * B::MR + i;
+                dst[k * B::MR + i] = row < M ? a[row * a_rs + (k0 + k) * a_cs] : 0;
+            }
+        }
+    }
+}
+
+// Copy rows [k0, k0 + kc) x cols [0, P) of B into NR-column panels, zero-padding the last panel.
+template <Number DType>
+void _gemm_pack_b(Size P, Size k0, Size kc, const DType* b, Size b_rs, Size b_cs, DType* packed) {
+    using B = GemmBlocking<DType>;
+    const Size panels = (P + B::NR - 1) / B::NR;
+
+#pragma omp parallel for if (std::size_t{P} * kc >= B::parallel_threshold)
+    for (Size panel = 0; panel < panels; panel++) {
+        DType* dst = packed + panel * B::NR * kc;
+        for (Size k = 0; k < kc; k++) {
+            for (Size j = 0; j < B::NR; j++) {
+                Size col = panel * B::NR + j;
+                dst[k * B::NR + j] = col < P ? b[(k0 + k) * b_rs + col * b_cs] : 0;
+            }
+        }
+    }
+}
+
+// One register of DType lanes (GCC/clang vector extension, lowered to whatever ISA is enabled).
+template <Number DType>
+using SimdVec [[gnu::vector_size(simd_bytes)]] = DType;
+
+// C[0:mr, 0:nr] (+)= packed A sliver x packed B sliver. The MR x NR accumulator is held in registers; the row loop is
+// unrolled at compile time since not every compiler does so at -O2.
+template <Number DType>
+void _gemm_micro_kernel(Size kc, const DType* a, const DType* b, DType* c, Size ldc, Size mr, Size nr,
+                        bool accumulate) {
+    using B = GemmBlocking<DType>;
+    using Vec = SimdVec<DType>;
+    constexpr Size lanes = sizeof(Vec) / sizeof(DType);
+    constexpr Size vecs = B::NR / lanes;
+
+    Vec acc[B::MR][vecs] = {};
+
+    for (Size k = 0; k < kc; k++) {
+        Vec b_k[vecs];
+        std::memcpy(b_k, b + k * B::NR, sizeof(b_k));
+        [&]<std::size_t... I>(std::index_sequence<I...>) {
+            ((
+                 [&] {
+                     const DType a_ik = a[k * B::MR + I];
+                     for (Size v = 0; v < vecs; v++) acc[I][v] += a_ik * b_k[v];
+                 }()),
+             ...);
+        }(std::make_index_sequence<B::MR>{});
+    }
+
+    for (Size i = 0; i < mr; i++) {
+        DType row[B::NR];
+        std::memcpy(row, acc[i], sizeof(row));
+        DType* c_row = c + i * ldc;
+        if (accumulate) {
+            for (Size j = 0; j < nr; j++) c_row[j] += row[j];
+        } else {
+            for (Size j = 0; j < nr; j++) c_row[j] = row[j];
+        }
+    }
+}
+
+template <Number DType>
+void _gemm(Size M, Size N, Size P, const DType* a, Size a_rs, Size a_cs, const DType* b, Size b_rs, Size b_cs,
+           DType* c, Size ldc, bool accumulate) {
+    using B = GemmBlocking<DType>;
+
+    if (N == 0) {
+        if (!accumulate) {
+            for (Size i = 0; i < M; i++) std::fill(c + i * ldc, c + i * ldc + P, DType{0});
+        }
+        return;
+    }
+
+    const Size padded_m = (M + B::MR - 1) / B::MR * B::MR;
+    const Size padded_p = (P + B::NR - 1) / B::NR * B::NR;
+    const Size max_kc = std::min(B::KC, N);
+    // packing writes every element, the padding included, so the scratch is left uninitialized
+    Scratch<DType> packed_a{padded_m * max_kc};
+    Scratch<DType> packed_b{max_kc * padded_p};
+
+    for (Size k0 = 0; k0 < N; k0 += B::KC) {
+        const Size kc = std::min(B::KC, N - k0);
+        const bool accumulate_block = accumulate || k0 > 0;
+
+        _gemm_pack_a(M, k0, kc, a, a_rs, a_cs, packed_a.data());
+        _gemm_pack_b(P, k0, kc, b, b_rs, b_cs, packed_b.data());
+
+        // each (MC x NC) block of C is owned by exactly one thread; the work is counted in std::size_t, as M * P * kc
+        // can overflow Size
+#pragma omp parallel for collapse(2) schedule(static) if (std::size_t{M} * P * kc >= B::parallel_threshold)
+        for (Size ic = 0; ic < M; ic += B::MC) {
+            for (Size jc = 0; jc < P; jc += B::NC) {
+                const Size i_end = std::min(ic + B::MC, M);
+                const Size j_end = std::min(jc + B::NC, P);
+                for (Size jr = jc; jr < j_end; jr += B::NR) {
+                    for (Size ir = ic; ir < i_end; ir += B::MR) {
+                        _gemm_micro_kernel(kc, packed_a.data() + ir * kc, packed_b.data() + jr * kc, c + ir * ldc + jr,
+                                           ldc, std::min(B::MR, i_end - ir), std::min(B::NR, j_end - jr),
+                                           accumulate_block);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// C (M x P) = A (M x N) * B (N x P). A and B are strided (see above); C is row-major with leading dimension ldc.
+// If accumulate is set, the product is added to C instead of overwriting it.
+// Scratch memory is one packed copy of a KC-deep slice of A and B, i.e. O(M x N + N x P) at most.
+template <Number DType>
+void gemm(Size M, Size N, Size P, const DType* a, Size a_rs, Size a_cs, const DType* b, Size b_rs, Size b_cs,
+          DType* c, Size ldc, bool accumulate = false) {
+    _record([=] { _gemm(M, N, P, a, a_rs, a_cs, b, b_rs, b_cs, c, ldc, accumulate); });
+}
+
+}  // namespace vgrad::kernel
+
+#endif  // VGRAD_GEMM_H_
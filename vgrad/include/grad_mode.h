@@ -0,0 +1,39 @@
+#ifndef VGRAD_GRAD_MODE_H_
+#define VGRAD_GRAD_MODE_H_
+
+namespace vgrad {
+
+inline thread_local bool _grad_enabled = true;
+
+// whether ops on this thread record the graph that backward() follows
+inline bool is_grad_enabled() { return _grad_enabled; }
+
+// Sets whether ops record the graph, for as long as it is alive.
+class _GradModeGuard {
+   public:
+    explicit _GradModeGuard(bool enabled) : previous_{_grad_enabled} { _grad_enabled = enabled; }
+    ~_GradModeGuard() { _grad_enabled = previous_; }
+
+    _GradModeGuard(const _GradModeGuard&) = delete;
+    _GradModeGuard& operator=(const _GradModeGuard&) = delete;
+
+   private:
+    const bool previous_;
+};
+
+// While a NoGradGuard is alive, ops on its thread only run their forward kernel: their results get no graph node and
+// no grad_fn, so they keep no references to their inputs, and backward() doesn't reach through them. Use it to
+// evaluate a model without training it. Guards nest.
+//
+//   {
+//       NoGradGuard no_grad;
+//       auto test_out = model(test_x);
+//   }
+class NoGradGuard : _GradModeGuard {
+   public:
+    NoGradGuard() : _GradModeGuard{false} {}
+};
+
+}  // namespace vgrad
+
+#endif  // VGRAD_GRAD_MODE_H_
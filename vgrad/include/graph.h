@@ -1,17 +1,63 @@
 #ifndef VGARD_GRAPH_H_
 #define VGARD_GRAPH_H_
 
+#include <array>
 #include <functional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 
 #include "tensor.h"
 
 namespace vgrad {
 
-template <IsNode InNode, IsShape _OutShape, Number _DType, cx::IsProductTerm Cx>
+// Stands in for the gradient of an input that doesn't require one; grad_fns neither compute nor return it.
+struct NoGrad {
+    NoGrad() = default;
+    NoGrad(Uninitialized) {}
+};
+
+template <IsNode Node>
+using GradTensor =
+    std::conditional_t<Node::requires_grad, Tensor<typename Node::OutShape, typename Node::DType>, NoGrad>;
+
+// where a grad_fn writes a gradient, or nullptr for a NoGrad
+template <Number DType, typename Grad>
+DType* _grad_data(Grad& grad) {
+    if constexpr (std::is_same_v<Grad, NoGrad>) {
+        return nullptr;
+    } else {
+        return grad._flat_data().data();
+    }
+}
+
+// a tuple of gradients with uninitialized data, for a grad_fn that writes every element of each
+template <typename Grads>
+Grads _uninitialized_grads() {
+    return []<std::size_t... Is>(std::index_sequence<Is...>) {
+        return Grads{std::tuple_element_t<Is, Grads>{uninitialized}...};
+    }(std::make_index_sequence<std::tuple_size_v<Grads>>{});
+}
+
+// A node that doesn't require a gradient never runs its grad_fn, so it doesn't keep one, nor the tensors the grad_fn
+// would capture. The grad_fn isn't even instantiated. Under a NoGradGuard, no node keeps one.
+template <bool RequiresGrad, typename GradFn, typename F>
+GradFn _make_grad_fn(F&& grad_fn) {
+    if constexpr (RequiresGrad) {
+        return is_grad_enabled() ? GradFn{std::forward<F>(grad_fn)} : GradFn{};
+    } else {
+        return GradFn{};
+    }
+}
+
+// Cx counts the elements a node writes, which gives both its memory and its time complexity. Ops that do more work
+// than they write (e.g. matmul) pass a separate TimeCx.
+template <IsNode InNode, IsShape _OutShape, Number _DType, cx::IsProductTerm Cx, cx::IsProductTerm TimeCx = Cx>
     requires std::is_same_v<typename InNode::DType, _DType>
 struct UnaryOpNode {
     static constexpr bool is_node = true;
     static constexpr bool is_unary_node = true;
+    static constexpr bool requires_grad = InNode::requires_grad;
 
     using DType = _DType;
     using InShape = InNode::OutShape;
@@ -20,46 +66,118 @@ struct UnaryOpNode {
     using OutTensor = Tensor<OutShape, DType>;
     using GradFn = std::function<InTensor(const OutTensor&)>;
 
-    const std::shared_ptr<InNode> in_node;
-    const GradFn grad_fn;
+    // not const, so that moving a node moves these instead of copying them
+    std::shared_ptr<InNode> in_node;
+    GradFn grad_fn;
+
+    template <typename F>
+    UnaryOpNode(const std::shared_ptr<InNode>& in_node, F&& grad_fn)
+        : in_node{in_node}, grad_fn{_make_grad_fn<requires_grad, GradFn>(std::forward<F>(grad_fn))} {}
 
     using ThisMemoryComplexity = cx::MakeComplexity<cx::ConstProductTerm<MemoryConstant<DType>, Cx>>;
     using TotalMemoryComplexity = cx::AddComplexities<ThisMemoryComplexity, typename InNode::TotalMemoryComplexity>;
 
-    using ThisTimeComplexity = cx::MakeComplexity<cx::ConstProductTerm<TimeConstant, Cx>>;
+    using ThisTimeComplexity = cx::MakeComplexity<cx::ConstProductTerm<TimeConstant, TimeCx>>;
     using TotalTimeComplexity = cx::AddComplexities<ThisTimeComplexity, typename InNode::TotalTimeComplexity>;
 };
 
-template <IsNode InNode1, IsNode InNode2, IsShape _OutShape, Number _DType, cx::IsProductTerm Cx>
+template <IsNode InNode1, IsNode InNode2, IsShape _OutShape, Number _DType, cx::IsProductTerm Cx,
+          cx::IsProductTerm TimeCx = Cx>
     requires std::is_same_v<typename InNode1::DType, _DType> && std::is_same_v<typename InNode2::DType, _DType>
 struct BinaryOpNode {
     static constexpr bool is_node = true;
     static constexpr bool is_binary_node = true;
+    static constexpr bool requires_grad = InNode1::requires_grad || InNode2::requires_grad;
 
     using DType = _DType;
     using InShape1 = InNode1::OutShape;
     using InShape2 = InNode2::OutShape;
-    using InTensor1 = Tensor<InShape1, DType>;
-    using InTensor2 = Tensor<InShape2, DType>;
+    // NoGrad for an input that doesn't require a gradient
+    using InGrad1 = GradTensor<InNode1>;
+    using InGrad2 = GradTensor<InNode2>;
     using OutShape = _OutShape;
     using OutTensor = Tensor<OutShape, DType>;
-    using GradFn = std::function<std::pair<InTensor1, InTensor2>(const OutTensor&)>;
+    using GradFn = std::function<std::pair<InGrad1, InGrad2>(const OutTensor&)>;
+
+    std::shared_ptr<InNode1> in_node1;
+    std::shared_ptr<InNode2> in_node2;
+    GradFn grad_fn;
 
-    const std::shared_ptr<InNode1> in_node1;
-    const std::shared_ptr<InNode2> in_node2;
-    const GradFn grad_fn;
+    template <typename F>
+    BinaryOpNode(const std::shared_ptr<InNode1>& in_node1, const std::shared_ptr<InNode2>& in_node2, F&& grad_fn)
+        : in_node1{in_node1},
+          in_node2{in_node2},
+          grad_fn{_make_grad_fn<requires_grad, GradFn>(std::forward<F>(grad_fn))} {}
 
     using ThisMemoryComplexity = cx::MakeComplexity<cx::ConstProductTerm<MemoryConstant<DType>, Cx>>;
     using TotalMemoryComplexity =
         cx::AddComplexities<ThisMemoryComplexity, cx::AddComplexities<typename InNode1::TotalMemoryComplexity,
                                                                       typename InNode2::TotalMemoryComplexity>>;
 
-    using ThisTimeComplexity = cx::MakeComplexity<cx::ConstProductTerm<TimeConstant, Cx>>;
+    using ThisTimeComplexity = cx::MakeComplexity<cx::ConstProductTerm<TimeConstant, TimeCx>>;
     using TotalTimeComplexity =
         cx::AddComplexities<ThisTimeComplexity, cx::AddComplexities<typename InNode1::TotalTimeComplexity,
                                                                     typename InNode2::TotalTimeComplexity>>;
 };
 
+// The result of a fused chain of element-wise ops (see expr.h), with one input per leaf of the chain. grad_fn returns
+// the gradients of all the inputs at once.
+template <IsShape _OutShape, Number _DType, cx::IsProductTerm Cx, IsNode... InNodes>
+    requires(std::is_same_v<typename InNodes::DType, _DType> && ...)
+struct FusedOpNode {
+    static constexpr bool is_node = true;
+    static constexpr bool is_fused_node = true;
+    static constexpr bool requires_grad = (InNodes::requires_grad || ...);
+
+    using DType = _DType;
+    // NoGrad for inputs that don't require a gradient
+    using InGrads = std::tuple<GradTensor<InNodes>...>;
+    using OutShape = _OutShape;
+    using OutTensor = Tensor<OutShape, DType>;
+    using GradFn = std::function<InGrads(const OutTensor&)>;
+
+    std::tuple<std::shared_ptr<InNodes>...> in_nodes;
+    GradFn grad_fn;
+
+    template <typename F>
+    FusedOpNode(std::tuple<std::shared_ptr<InNodes>...> in_nodes, F&& grad_fn)
+        : in_nodes{std::move(in_nodes)}, grad_fn{_make_grad_fn<requires_grad, GradFn>(std::forward<F>(grad_fn))} {}
+
+    using ThisMemoryComplexity = cx::MakeComplexity<cx::ConstProductTerm<MemoryConstant<DType>, Cx>>;
+    using TotalMemoryComplexity =
+        cx::SumComplexities<ThisMemoryComplexity, typename InNodes::TotalMemoryComplexity...>;
+
+    using ThisTimeComplexity = cx::MakeComplexity<cx::ConstProductTerm<TimeConstant, Cx>>;
+    using TotalTimeComplexity = cx::SumComplexities<ThisTimeComplexity, typename InNodes::TotalTimeComplexity...>;
+};
+
+// The result of a checkpointed segment (see checkpoint.h). Instead of the activations inside the segment, it keeps the
+// segment's inputs and fn, and backward() runs fn again to recover them, so only the result adds to the memory
+// complexity. The time complexity counts the segment's forward pass once.
+template <typename Fn, IsTensor... Inputs>
+struct CheckpointNode {
+    static constexpr bool is_node = true;
+    static constexpr bool is_checkpoint_node = true;
+
+    using Result = std::invoke_result_t<const Fn&, const Inputs&...>;
+    static constexpr bool requires_grad = Result::requires_grad;
+
+    using DType = typename Result::DType;
+    using OutShape = typename Result::Shape;
+
+    static constexpr std::array<bool, sizeof...(Inputs)> input_requires_grad{Inputs::requires_grad...};
+
+    std::tuple<Inputs...> inputs;
+    Fn fn;
+
+    using ThisMemoryComplexity =
+        cx::MakeComplexity<cx::ConstProductTerm<MemoryConstant<DType>, cx::ProductTermFromShape<OutShape>>>;
+    using TotalMemoryComplexity =
+        cx::SumComplexities<ThisMemoryComplexity, typename Inputs::Node::TotalMemoryComplexity...>;
+
+    using TotalTimeComplexity = typename Result::Node::TotalTimeComplexity;
+};
+
 }  // namespace vgrad
 
 #endif  // VGARD_GRAPH_H_
\ No newline at end of file
@@ -0,0 +1,165 @@
+#ifndef VGRAD_LAYOUT_H_
+#define VGRAD_LAYOUT_H_
+
+#include <array>
+#include <utility>
+
+#include "shape.h"
+
+namespace vgrad {
+
+// One term of a storage index: ((flat_index / step) % extent) * stride.
+struct IndexTerm {
+    Size step;
+    Size extent;
+    Size stride;
+};
+
+// Maps a tensor's row-major flat index to a position in its storage buffer. A contiguous tensor uses its shape's own
+// strides. Views (transpose, unsqueeze, repeat, broadcast, ...) share their input's buffer and only change the
+// strides, so a layout also records the size of that buffer and where the view starts in it.
+//
+// Build layouts through make_layout(), which canonicalizes the strides of size-1 dimensions; then a layout is
+// contiguous exactly when it is ContiguousLayout<Shape>.
+template <IsShape _Shape, Size _StorageSize, Size _Offset, Size... _Strides>
+    requires(sizeof...(_Strides) == _Shape::rank)
+struct StridedLayout {
+    static constexpr bool is_layout = true;
+
+    using Shape = _Shape;
+    static constexpr Size storage_size = _StorageSize;
+    static constexpr Size offset = _Offset;
+    static constexpr std::array<Size, Shape::rank> strides{_Strides...};
+
+    static constexpr bool is_contiguous = offset == 0 && storage_size == Shape::flat_size && strides == Shape::strides;
+
+    // Merge runs of dimensions that are laid out back to back, and drop dimensions that don't move through storage
+    // (extent 1, or stride 0 as in a repeat). A contiguous tensor ends up with the single term (1, flat_size, 1).
+    static constexpr auto compute_terms() {
+        std::array<IndexTerm, Shape::rank> result{};
+        Size count = 0;
+        for (Size d = Shape::rank; d-- > 0;) {
+            const Size step = Shape::strides[d];
+            const Size extent = Shape::extents[d];
+            const Size stride = strides[d];
+            if (extent == 1 || stride == 0) continue;
+
+            if (count > 0) {
+                auto& last = result[count - 1];
+                if (step == last.step * last.extent && stride == last.stride * last.extent) {
+                    last.extent *= extent;
+                    continue;
+                }
+            }
+            result[count++] = {step, extent, stride};
+        }
+        return std::make_pair(result, count);
+    }
+
+    // If this layout is two axes of a contiguous buffer swapped, those axes (i1 < i2); otherwise {0, 0}.
+    static constexpr auto compute_transposed_axes() {
+        if (offset != 0 || storage_size != Shape::flat_size) return std::make_pair(Size{0}, Size{0});
+        for (Size i1 = 0; i1 < Shape::rank; i1++) {
+            for (Size i2 = i1 + 1; i2 < Shape::rank; i2++) {
+                // strides of the untransposed buffer, with axes i1 and i2 swapped back
+                auto extents = Shape::extents;
+                std::swap(extents[i1], extents[i2]);
+                std::array<Size, Shape::rank> source{};
+                for (Size d = Shape::rank, step = 1; d-- > 0;) {
+                    source[d] = step;
+                    step *= extents[d];
+                }
+                std::swap(source[i1], source[i2]);
+
+                bool match = true;
+                for (Size d = 0; d < Shape::rank; d++) {
+                    // (make_layout canonicalized size-1 strides)
+                    if (Shape::extents[d] != 1 && source[d] != strides[d]) match = false;
+                }
+                if (match) return std::make_pair(i1, i2);
+            }
+        }
+        return std::make_pair(Size{0}, Size{0});
+    }
+
+    static constexpr auto transposed_axes = compute_transposed_axes();
+
+    static constexpr Size term_count = compute_terms().second;
+    static constexpr auto terms = compute_terms().first;
+
+    // All divisors are compile-time constants, and terms that can't matter are skipped, so this compiles to i for a
+    // contiguous layout and to a couple of multiply-shifts for the usual views.
+    static constexpr Size storage_index(Size flat_index) {
+        return [&]<std::size_t... I>(std::index_sequence<I...>) {
+            return (offset + ... + term<terms[I].step, terms[I].extent, terms[I].stride>(flat_index));
+        }(std::make_index_sequence<term_count>{});
+    }
+
+    template <Size Step, Size Extent, Size Stride>
+    static constexpr Size term(Size flat_index) {
+        Size index = flat_index;
+        if constexpr (Step != 1) index /= Step;
+        if constexpr (Step * Extent != Shape::flat_size) index %= Extent;
+        return index * Stride;
+    }
+};
+
+// strides_fn is a captureless lambda returning the strides. (Strides are passed as a pack rather than a std::array
+// template argument, which some compilers don't compare reliably.)
+template <IsShape Shape, Size StorageSize, Size Offset, typename StridesFn>
+constexpr auto make_layout(StridesFn) {
+    constexpr auto strides = [] {
+        std::array<Size, Shape::rank> result = StridesFn{}();
+        // a size-1 dimension is never stepped through, so give it the stride a contiguous tensor would have
+        for (Size d = 0; d < Shape::rank; d++) {
+            if (Shape::extents[d] == 1) result[d] = Shape::strides[d];
+        }
+        return result;
+    }();
+
+    return [&]<std::size_t... I>(std::index_sequence<I...>) {
+        return StridedLayout<Shape, StorageSize, Offset, strides[I]...>{};
+    }(std::make_index_sequence<Shape::rank>{});
+}
+
+template <IsShape Shape, typename = std::make_index_sequence<Shape::rank>>
+struct ContiguousLayoutHelper;
+
+template <IsShape Shape, std::size_t... I>
+struct ContiguousLayoutHelper<Shape, std::index_sequence<I...>> {
+    using type = StridedLayout<Shape, Shape::flat_size, 0, Shape::strides[I]...>;
+};
+
+template <IsShape Shape>
+using ContiguousLayout = typename ContiguousLayoutHelper<Shape>::type;
+
+// stride array helpers for building views
+
+template <std::size_t N>
+constexpr auto strides_insert(std::array<Size, N> strides, Size index, Size value) {
+    std::array<Size, N + 1> result{};
+    for (Size d = 0, s = 0; d < N + 1; d++) {
+        result[d] = d == index ? value : strides[s++];
+    }
+    return result;
+}
+
+template <std::size_t N>
+    requires(N > 0)
+constexpr auto strides_remove(std::array<Size, N> strides, Size index) {
+    std::array<Size, N - 1> result{};
+    for (Size d = 0, s = 0; s < N; s++) {
+        if (s != index) result[d++] = strides[s];
+    }
+    return result;
+}
+
+template <std::size_t N>
+constexpr auto strides_swap(std::array<Size, N> strides, Size index1, Size index2) {
+    std::swap(strides[index1], strides[index2]);
+    return strides;
+}
+
+}  // namespace vgrad
+
+#endif  // VGRAD_LAYOUT_H_
@@ -0,0 +1,181 @@
+#ifndef VGRAD_MICRO_BATCH_H_
+#define VGRAD_MICRO_BATCH_H_
+
+#include <concepts>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "backward.h"
+#include "capture.h"
+#include "elementwise.h"
+#include "ops.h"
+
+namespace vgrad {
+
+// Shape with its first dimension divided into K parts.
+template <IsShape S, Size K>
+using _MicroShape = typename S::template Remove<0>::template Insert<0, Dimension<S::template At<0>::value / K>>;
+
+// A batch of inputs (e.g. images and their labels) split into K micro-batches along their first dimension. Micro-batch
+// k of each input is its rows k * N / K to (k + 1) * N / K, as a contiguous tensor that shares the input's buffer. The
+// inputs are data: no gradient flows back to them. Non-contiguous inputs are copied once, when the batches are made.
+//
+//   auto batches = micro_batches<10>(images, labels);
+//   optimizer.step_micro_batches(batches, [&](const auto& x, const auto& y) { return cross_entropy(model(x), y); });
+template <Size K, IsTensor... Inputs>
+    requires(K > 0) && (sizeof...(Inputs) > 0) && ((Inputs::Shape::rank > 0 && !Inputs::requires_grad) && ...) &&
+            ((Inputs::Shape::template At<0>::value % K == 0) && ...)
+class MicroBatches {
+   public:
+    static constexpr Size count = K;
+
+    // one micro-batch of every input
+    using Batch = std::tuple<Tensor<_MicroShape<typename Inputs::Shape, K>, typename Inputs::DType>...>;
+
+    // the loss that loss_fn computes from a micro-batch; its mem_complexity is that of a single micro-batch
+    template <typename LossFn>
+    using Loss = decltype(std::apply(std::declval<const LossFn&>(), std::declval<const Batch&>()));
+
+    explicit MicroBatches(const Inputs&... inputs) : data_{contiguous(inputs).get_data()...} {}
+
+    // micro-batch k, viewing the inputs
+    Batch at(Size k) const {
+        return [&]<std::size_t... Is>(std::index_sequence<Is...>) {
+            return Batch{slice<Is>(k)...};
+        }(std::index_sequence_for<Inputs...>{});
+    }
+
+    // Copy micro-batch k into tensors of its own.
+    void copy_to(Size k, const Batch& batch) const {
+        [&]<std::size_t... Is>(std::index_sequence<Is...>) {
+            ([&] {
+                using Micro = std::tuple_element_t<Is, Batch>;
+                auto dst = std::get<Is>(batch);  // shares the buffer
+                auto dst_data = dst._flat_data().data();
+                auto src_data = std::get<Is>(data_)->data() + k * Micro::Shape::flat_size;
+                kernel::elementwise<Micro::Shape::flat_size>([=](Size i) { dst_data[i] = src_data[i]; });
+            }(),
+             ...);
+        }(std::index_sequence_for<Inputs...>{});
+    }
+
+   private:
+    std::tuple<std::shared_ptr<typename Inputs::Contiguous::Storage>...> data_;
+
+    template <std::size_t I>
+    auto slice(Size k) const {
+        using Micro = std::tuple_element_t<I, Batch>;
+        const auto& data = std::get<I>(data_);
+        return Micro{std::shared_ptr<typename Micro::Storage>(
+            data, reinterpret_cast<typename Micro::Storage*>(data->data() + k * Micro::Shape::flat_size))};
+    }
+};
+
+template <typename T>
+concept IsMicroBatches = requires {
+    { T::count } -> std::convertible_to<Size>;
+    typename T::Batch;
+};
+
+template <Size K, IsTensor... Inputs>
+auto micro_batches(const Inputs&... inputs) {
+    return MicroBatches<K, Inputs...>{inputs...};
+}
+
+// The mean of loss_fn over the micro-batches, and its gradients with respect to params, which are written into grads,
+// replacing what they hold. loss_fn computes the loss of one micro-batch from its inputs (a mean over the micro-batch,
+// say), and may use params directly, as a module does. The micro-batches run one after the other, so memory peaks at
+// what a single one needs, while the gradients come out as for the whole batch.
+//
+// Under a CapturedStep, only the first micro-batch is recorded; the rest replay its kernels on copies of their inputs,
+// so the capture too holds a single micro-batch. Recording runs each micro-batch once, like a replay.
+template <IsMicroBatches Batches, typename LossFn, IsTensor... Params>
+    requires IsScalarTensor<typename Batches::template Loss<LossFn>> &&
+             IsFloatTensor<typename Batches::template Loss<LossFn>> && (IsFloatTensor<Params> && ...) &&
+             (Params::requires_grad && ...)
+auto micro_batch_grad_to(const Batches& batches, const LossFn& loss_fn,
+                         const std::tuple<typename Params::Contiguous...>& grads, const Params&... params) {
+    PROFILE_SCOPE("micro_batch_grad_to");
+    using Loss = typename Batches::template Loss<LossFn>;
+    using DType = typename Loss::DType;
+    constexpr Size count = Batches::count;
+    const DType scale = DType{1} / count;
+
+    typename Loss::Contiguous total{uninitialized};
+    auto total_data = total._flat_data().data();
+
+    if (!_current_capture) {
+        for (Size k = 0; k < count; k++) {
+            auto loss = std::apply(loss_fn, batches.at(k)) * scale;
+            if (k == 0) {
+                backward_to(loss, grads, params...);
+                total_data[0] = loss.value();
+            } else {
+                backward_into(loss, grads, params...);
+                total_data[0] += loss.value();
+            }
+        }
+        return total;
+    }
+
+    // zero the gradients and the total
+    const auto zero = [=] {
+        std::apply(
+            [](auto... grads) {
+                ([&] {
+                    auto grad_data = grads._flat_data().data();
+                    kernel::elementwise<decltype(grads)::Shape::flat_size>([=](Size i) { grad_data[i] = 0; });
+                }(),
+                 ...);
+            },
+            grads);
+        total_data[0] = 0;
+    };
+
+    // the recording step runs the first micro-batch as it is recorded, so it starts from zeroed gradients here; this
+    // setup isn't part of the capture
+    typename Batches::Batch inputs;
+    {
+        _CaptureGuard eager{nullptr};
+        zero();
+        batches.copy_to(0, inputs);
+    }
+
+    // record the first micro-batch on its own, from inputs that each micro-batch is copied into in turn
+    auto micro_step = std::make_shared<_Capture>();
+    {
+        _CaptureGuard guard{micro_step.get()};
+        auto loss = std::apply(loss_fn, inputs) * scale;
+        backward_into(loss, grads, params...);
+        auto loss_data = loss.get_data()->data() + decltype(loss)::Layout::offset;
+        _record([=] { total_data[0] += loss_data[0]; });
+    }
+
+    // the other micro-batches now; a replay runs all of them, from zeroed gradients
+    _record([=, first = Size{1}]() mutable {
+        if (first == 0) zero();
+        for (Size k = first; k < count; k++) {
+            batches.copy_to(k, inputs);
+            for (const auto& kernel : micro_step->kernels) kernel();
+        }
+        first = 0;
+    });
+    return total;
+}
+
+// The mean loss over the micro-batches and its gradients with respect to params (see micro_batch_grad_to()).
+//
+//   auto [loss, grads] = micro_batch_grad(batches, [&](const auto& x, const auto& y) { return mse(model(x), y); }, w);
+template <IsMicroBatches Batches, typename LossFn, IsTensor... Params>
+auto micro_batch_grad(const Batches& batches, const LossFn& loss_fn, const Params&... params) {
+    PROFILE_SCOPE("micro_batch_grad");
+    auto grads = std::make_tuple(typename Params::Contiguous{uninitialized}...);
+    auto loss = micro_batch_grad_to(batches, loss_fn, grads, params...);
+    return std::make_pair(loss, grads);
+}
+
+}  // namespace vgrad
+
+#endif  // VGRAD_MICRO_BATCH_H_
@@ -31,8 +31,8 @@ class Linear {
    private:
     using WShape = MakeShape<In, Out>;
     using BShape = MakeShape<Out>;
-    Tensor<WShape, DType> w = randn<DType, WShape>();
-    Tensor<BShape, DType> b = randn<DType, BShape>();
+    Param<WShape, DType> w = randn<DType, WShape>().as_param();
+    Param<BShape, DType> b = randn<DType, BShape>().as_param();
 };
 
 }  // namespace vgrad
@@ -5,37 +5,135 @@
 #include <omp.h>
 #endif
 
-#include <span>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
 #include <stdexcept>
+#include <utility>
 
+#include "elementwise.h"
+#include "expr.h"
+#include "forward.h"
+#include "gemm.h"
 #include "graph.h"
+#include "reduce.h"
 #include "tensor.h"
+#include "transcendental.h"
+#include "transpose.h"
 
 namespace vgrad {
 
+// Operands of the element-wise ops may be tensors or lazy expressions (see expr.h).
 template <typename A, typename B>
-concept TensorBinaryOpCompatible = TensorDTypeCompatible<A, B> && TensorShapeBroadcastCompatible<A, B>;
+concept TensorBinaryOpCompatible =
+    IsOperand<A> && IsOperand<B> && std::is_same_v<typename A::DType, typename B::DType> &&
+    std::is_same_v<typename A::Shape::template Last<std::min(A::Shape::rank, B::Shape::rank)>,
+                   typename B::Shape::template Last<std::min(A::Shape::rank, B::Shape::rank)>>;
 
 using OneDimension = Dimension<1>;  // for unsqueeze
 
+// Share a's buffer under a new layout. Views write nothing, so they add no memory or time complexity.
+template <IsTensor A, IsLayout NewLayout>
+auto _view(const A& a, NewLayout, auto grad_fn) {
+    using NewShape = typename NewLayout::Shape;
+    using Node = UnaryOpNode<typename A::Node, NewShape, typename A::DType, cx::ProductTerm<cx::ZeroPolyTerm>>;
+    return Tensor<NewShape, typename A::DType, Node, NewLayout>{a.get_data(), Node{a.get_node(), std::move(grad_fn)}};
+}
+
+// Same as _view(), for use in kernels and grad functions.
+template <IsTensor A, IsLayout NewLayout>
+auto _view_no_grad(const A& a, NewLayout) {
+    using NewShape = typename NewLayout::Shape;
+    return Tensor<NewShape, typename A::DType, LeafNode<NewShape, typename A::DType>, NewLayout>{a.get_data()};
+}
+
+template <IsTensor A>
+auto _contiguous_no_grad(const A& a) {
+    PROFILE_SCOPE("_contiguous_no_grad");
+    using Shape = typename A::Shape;
+    Tensor<Shape, typename A::DType> result{uninitialized};
+
+    auto a_data = a.storage_view().data();
+    auto result_data = result._flat_data().data();
+
+    constexpr auto axes = A::Layout::transposed_axes;
+    if constexpr (!A::Layout::is_contiguous && axes.first != axes.second) {
+        // a plain transpose of a contiguous buffer: copy it tile by tile
+        constexpr Size inner = Shape::strides[axes.second];
+        constexpr Size mid = Shape::strides[axes.first] / (Shape::extents[axes.second] * inner);
+        constexpr Size outer = Shape::flat_size / (Shape::strides[axes.first] * Shape::extents[axes.first]);
+        kernel::transpose<outer, Shape::extents[axes.second], mid, Shape::extents[axes.first], inner>(a_data,
+                                                                                                      result_data);
+    } else {
+        kernel::elementwise<Shape::flat_size>([=](Size i) { result_data[i] = a_data[A::Layout::storage_index(i)]; });
+    }
+
+    return result;
+}
+
+// Forward mode: the tangents of a copy are copies of the tangents.
+template <IsTensor A, IsTensor Result>
+void _copy_tangent(const A& a, const Result& result) {
+    auto t_a = _tangent(a);
+    if (!t_a) return;
+    auto t_result = _current_tangents->emplace(result);
+    const Size count = _current_tangents->count();
+    kernel::elementwise<A::Shape::flat_size>([=](Size i) {
+        const Size index = A::Layout::storage_index(i);
+        for (Size k = 0; k < count; k++) {
+            t_result[k * A::Shape::flat_size + i] = t_a[k * A::Layout::storage_size + index];
+        }
+    });
+}
+
+// Copy a view into a buffer of its own. Returns contiguous tensors as-is.
+template <IsTensor A>
+auto contiguous(const A& a) {
+    PROFILE_SCOPE("contiguous");
+    if constexpr (A::Layout::is_contiguous) {
+        return a;
+    } else {
+        auto raw_result = _contiguous_no_grad(a);
+        _copy_tangent(a, raw_result);
+
+        using Node = UnaryOpNode<typename A::Node, typename A::Shape, typename A::DType,
+                                 cx::ProductTermFromShape<typename A::Shape>>;
+
+        return Tensor<typename A::Shape, typename A::DType, Node>{
+            raw_result.get_data(),
+            Node{
+                a.get_node(),
+                [](const auto& dl_df) { return dl_df; },
+            },
+        }
+            .bind_profile(PROFILE_NODE);
+    }
+}
+
 template <IsShape NewShape, IsTensor A>
     requires(A::Shape::flat_size == NewShape::flat_size)
 auto reshape(const A& a) {
     PROFILE_SCOPE("reshape");
-    using Node = UnaryOpNode<typename A::Node, NewShape, typename A::DType, cx::ProductTerm<cx::ZeroPolyTerm>>;
-
-    return Tensor<NewShape, typename A::DType, Node>{
-        a.get_data(),
-        Node{
-            a.get_node(),
-            [](const auto& dl_df) {
-                PROFILE_SCOPE("reshape::grad");
-                return Tensor<typename A::Shape, typename A::DType>{dl_df.get_data()};
+    if constexpr (!A::Layout::is_contiguous) {
+        return reshape<NewShape>(contiguous(a));
+    } else {
+        using Node = UnaryOpNode<typename A::Node, NewShape, typename A::DType, cx::ProductTerm<cx::ZeroPolyTerm>>;
+
+        return Tensor<NewShape, typename A::DType, Node>{
+            a.get_data(),
+            Node{
+                a.get_node(),
+                [](const auto& dl_df) {
+                    PROFILE_SCOPE("reshape::grad");
+                    return Tensor<typename A::Shape, typename A::DType>{dl_df.get_data()};
+                },
             },
-        },
-    };
+        };
+    }
 }
 
+// View b as NewShape by giving the new leading dimensions stride 0.
 template <IsShape NewShape, IsTensor B>
     requires TensorShapeBroadcastCompatible<Tensor<NewShape, typename B::DType>, B> &&
              (NewShape::rank >= B::Shape::rank)
@@ -44,126 +142,227 @@ auto broadcast(const B& b) {
     if constexpr (NewShape::rank == B::Shape::rank) {
         return b;
     } else {
-        using Repeat = Dimension<NewShape::flat_size / B::Shape::flat_size>;
-        return reshape<NewShape>(repeat<0, Repeat>(unsqueeze<0>(b))).bind_profile(PROFILE_NODE);
+        auto layout = make_layout<NewShape, B::Layout::storage_size, B::Layout::offset>([] {
+            std::array<Size, NewShape::rank> result{};
+            constexpr Size lead = NewShape::rank - B::Shape::rank;
+            for (Size d = 0; d < B::Shape::rank; d++) result[lead + d] = B::Layout::strides[d];
+            return result;
+        });
+
+        return _view(b, layout, [](const auto& dl_df) {
+                   PROFILE_SCOPE("broadcast::grad");
+                   constexpr Size size = B::Shape::flat_size;
+                   constexpr Size repeats = NewShape::flat_size / size;
+                   Tensor<typename B::Shape, typename B::DType> dl_db{uninitialized};
+
+                   auto dl_df_data = dl_df.flat_view().data();
+                   auto dl_db_data = dl_db._flat_data().data();
+                   kernel::elementwise<size>([=](Size i) {
+                       typename B::DType sum = 0;
+                       for (Size k = 0; k < repeats; k++) sum += dl_df_data[k * size + i];
+                       dl_db_data[i] = sum;
+                   });
+
+                   return dl_db;
+               })
+            .bind_profile(PROFILE_NODE);
     }
 }
 
-template <IsTensor A>
-auto _unary_op(const A& a, auto forward, auto backward) {
+// Loop over a's elements with kernel::elementwise_rare(), rare() applied to the element of a at each index, or with a
+// plain kernel::elementwise() given kernel::NoRareCase. body(i, large) either way.
+template <IsTensor A, typename Rare, typename Body>
+void _unary_elementwise(const typename A::DType* a_data, Rare rare, Body body) {
+    if constexpr (std::is_same_v<Rare, kernel::NoRareCase>) {
+        kernel::elementwise<A::Shape::flat_size>([=](Size i) { body(i, std::false_type{}); });
+    } else {
+        kernel::elementwise_rare<A::Shape::flat_size>(
+            [=](Size i) { return rare(a_data[A::Layout::storage_index(i)]); }, body);
+    }
+}
+
+// f(args..., large) for element functions that take whether the chunk has a rare element, f(args...) for the rest
+template <typename F, typename Large, typename... Args>
+auto _unary_call(const F& f, Large large, Args... args) {
+    if constexpr (std::is_invocable_v<const F&, Args..., Large>) {
+        return f(args..., large);
+    } else {
+        return f(args...);
+    }
+}
+
+// forward(x) and backward(x, y) compute an element of the result and its derivative. Given rare (see
+// kernel::elementwise_rare()), they also take a std::bool_constant that says whether the chunk has a rare element.
+template <IsTensor A, typename Rare = kernel::NoRareCase>
+auto _unary_op(const A& a, auto forward, auto backward, Rare rare = {}) {
     PROFILE_SCOPE("_unary_op");
     using Node = UnaryOpNode<typename A::Node, typename A::Shape, typename A::DType,
                              cx::ProductTermFromShape<typename A::Shape>>;
 
-    Tensor<typename A::Shape, typename A::DType, Node> result{Node{
-        a.get_node(),
-        [a, backward](const auto& dl_df) {
-            PROFILE_SCOPE("_unary_op::grad");
-            Tensor<typename A::Shape, typename A::DType> dl_da;
-
-#pragma omp parallel for
-            for (Size i = 0; i < A::Shape::flat_size; i++) {
-                auto df_da = backward(a.flat_view()[i]);
-                dl_da._flat_data()[i] = dl_df.flat_view()[i] * df_da;
+    Tensor<typename A::Shape, typename A::DType> raw_result{uninitialized};
+
+    auto a_data = a.storage_view().data();
+    auto result_data = raw_result._flat_data().data();
+    _unary_elementwise<A>(a_data, rare, [=](Size i, auto large) {
+        result_data[i] = _unary_call(forward, large, a_data[A::Layout::storage_index(i)]);
+    });
+
+    // forward mode: the tangents are scaled by the derivative that the grad_fn uses
+    if (auto t_a = _tangent(a)) {
+        auto t_result = _current_tangents->emplace(raw_result);
+        const Size count = _current_tangents->count();
+        _unary_elementwise<A>(a_data, rare, [=](Size i, auto large) {
+            const Size index = A::Layout::storage_index(i);
+            const typename A::DType d = _unary_call(backward, large, a_data[index], result_data[i]);
+            for (Size k = 0; k < count; k++) {
+                t_result[k * A::Shape::flat_size + i] = d * t_a[k * A::Layout::storage_size + index];
             }
+        });
+    }
 
-            return dl_da;
+    return Tensor<typename A::Shape, typename A::DType, Node>{
+        raw_result.get_data(),
+        Node{
+            a.get_node(),
+            // grad_fns keep their inputs' data, not their nodes, which the graph holds already
+            [a = a.detach(), y = raw_result.get_data(), backward, rare](const auto& dl_df) {
+                PROFILE_SCOPE("_unary_op::grad");
+                Tensor<typename A::Shape, typename A::DType> dl_da{uninitialized};
+
+                auto a_data = a.storage_view().data();
+                auto y_data = y->data();
+                auto dl_df_data = dl_df.flat_view().data();
+                auto dl_da_data = dl_da._flat_data().data();
+                _unary_elementwise<A>(a_data, rare, [=](Size i, auto large) {
+                    dl_da_data[i] =
+                        dl_df_data[i] * _unary_call(backward, large, a_data[A::Layout::storage_index(i)], y_data[i]);
+                });
+
+                return dl_da;
+            },
         },
-    }};
-
-#pragma omp parallel for
-    for (Size i = 0; i < A::Shape::flat_size; i++) {
-        result._flat_data()[i] = forward(a.flat_view()[i]);
     }
-
-    return result.bind_profile(PROFILE_NODE);
+        .bind_profile(PROFILE_NODE);
 }
 
+// The lower-rank operand is broadcast by indexing, never copied. Its gradient sums over the broadcast rows directly
+// into a tensor of its own shape.
 template <IsTensor A, IsTensor B>
-auto _binary_op_same_shape(const A& a, const B& b, auto forward, auto backward_a, auto backward_b) {
-    PROFILE_SCOPE("_binary_op_same_shape");
-    using Node = BinaryOpNode<typename A::Node, typename B::Node, typename A::Shape, typename A::DType,
-                              cx::ProductTermFromShape<typename A::Shape>>;
+    requires TensorBinaryOpCompatible<A, B>
+auto _binary_op(const A& a, const B& b, auto forward, auto backward_a, auto backward_b) {
+    PROFILE_SCOPE("_binary_op");
+    using OutShape = std::conditional_t<(A::Shape::rank >= B::Shape::rank), typename A::Shape, typename B::Shape>;
+    constexpr Size size = OutShape::flat_size;
+    using Node = BinaryOpNode<typename A::Node, typename B::Node, OutShape, typename A::DType,
+                              cx::ProductTermFromShape<OutShape>>;
 
-    Tensor<typename A::Shape, typename A::DType, Node> result{Node{
+    Tensor<OutShape, typename A::DType, Node> result{uninitialized, Node{
         a.get_node(),
         b.get_node(),
-        [a, b, backward_a, backward_b](const auto& dl_df) {
-            PROFILE_SCOPE("_binary_op_same_shape::grad");
-            Tensor<typename A::Shape, typename A::DType> dl_da;
-            Tensor<typename B::Shape, typename B::DType> dl_db;
-
-#pragma omp parallel
-            for (Size i = 0; i < A::Shape::flat_size; i++) {
-                auto df_da = backward_a(a.flat_view()[i], b.flat_view()[i]);
-                auto df_db = backward_b(a.flat_view()[i], b.flat_view()[i]);
-                dl_da._flat_data()[i] = dl_df.flat_view()[i] * df_da;
-                dl_db._flat_data()[i] = dl_df.flat_view()[i] * df_db;
+        [a = a.detach(), b = b.detach(), backward_a, backward_b](const auto& dl_df) {
+            PROFILE_SCOPE("_binary_op::grad");
+            typename Node::InGrad1 dl_da{uninitialized};
+            typename Node::InGrad2 dl_db{uninitialized};
+
+            auto a_data = a.storage_view().data();
+            auto b_data = b.storage_view().data();
+            auto dl_df_data = dl_df.flat_view().data();
+            auto dl_da_data = _grad_data<typename A::DType>(dl_da);
+            auto dl_db_data = _grad_data<typename B::DType>(dl_db);
+
+            auto dl_da_term = [=](Size i) {
+                auto x = a_data[_broadcast_index<A, size>(i)];
+                auto y = b_data[_broadcast_index<B, size>(i)];
+                return dl_df_data[i] * backward_a(x, y);
+            };
+            auto dl_db_term = [=](Size i) {
+                auto x = a_data[_broadcast_index<A, size>(i)];
+                auto y = b_data[_broadcast_index<B, size>(i)];
+                return dl_df_data[i] * backward_b(x, y);
+            };
+
+            // only the inputs that require a gradient get one
+            if constexpr (A::Shape::flat_size == B::Shape::flat_size) {
+                kernel::elementwise<size>([=](Size i) {
+                    if constexpr (A::requires_grad) dl_da_data[i] = dl_da_term(i);
+                    if constexpr (B::requires_grad) dl_db_data[i] = dl_db_term(i);
+                });
+            } else if constexpr (A::Shape::flat_size == size) {
+                if constexpr (A::requires_grad) {
+                    kernel::elementwise<size>([=](Size i) { dl_da_data[i] = dl_da_term(i); });
+                }
+                if constexpr (B::requires_grad) {
+                    kernel::column_sums<size / B::Shape::flat_size, B::Shape::flat_size>(dl_db_data, dl_db_term);
+                }
+            } else {
+                if constexpr (A::requires_grad) {
+                    kernel::column_sums<size / A::Shape::flat_size, A::Shape::flat_size>(dl_da_data, dl_da_term);
+                }
+                if constexpr (B::requires_grad) {
+                    kernel::elementwise<size>([=](Size i) { dl_db_data[i] = dl_db_term(i); });
+                }
             }
 
             return std::make_pair(dl_da, dl_db);
         },
     }};
 
-#pragma omp parallel
-    for (Size i = 0; i < A::Shape::flat_size; i++) {
-        result._flat_data()[i] = forward(a.flat_view()[i], b.flat_view()[i]);
+    auto a_data = a.storage_view().data();
+    auto b_data = b.storage_view().data();
+    auto result_data = result._flat_data().data();
+    kernel::elementwise<size>([=](Size i) {
+        result_data[i] = forward(a_data[_broadcast_index<A, size>(i)], b_data[_broadcast_index<B, size>(i)]);
+    });
+
+    // forward mode: each operand's tangents are scaled by the derivative that the grad_fn uses; an operand without
+    // tangents adds nothing
+    auto t_a = _tangent(a);
+    auto t_b = _tangent(b);
+    if (t_a || t_b) {
+        auto t_result = _current_tangents->emplace(result);
+        const Size count = _current_tangents->count();
+        kernel::elementwise<size>([=](Size i) {
+            const Size a_index = _broadcast_index<A, size>(i);
+            const Size b_index = _broadcast_index<B, size>(i);
+            const auto x = a_data[a_index];
+            const auto y = b_data[b_index];
+            const typename A::DType da = t_a ? backward_a(x, y) : 0;
+            const typename A::DType db = t_b ? backward_b(x, y) : 0;
+            for (Size k = 0; k < count; k++) {
+                typename A::DType t = 0;
+                if (t_a) t += da * t_a[k * A::Layout::storage_size + a_index];
+                if (t_b) t += db * t_b[k * B::Layout::storage_size + b_index];
+                t_result[k * size + i] = t;
+            }
+        });
     }
 
     return result.bind_profile(PROFILE_NODE);
 }
 
-template <IsTensor A, IsTensor B>
-    requires TensorBinaryOpCompatible<A, B>
-auto _binary_op(const A& a, const B& b, auto forward, auto backward_a, auto backward_b) {
-    PROFILE_SCOPE("_binary_op");
-    if constexpr (A::Shape::rank > B::Shape::rank) {
-        return _binary_op_same_shape(a, broadcast<typename A::Shape>(b), forward, backward_a, backward_b);
-    } else {
-        return _binary_op_same_shape(broadcast<typename B::Shape>(a), b, forward, backward_a, backward_b);
-    }
+template <Index I1, Index I2, IsTensor A>
+constexpr auto _transpose_layout() {
+    using NewShape = typename A::Shape::template Transpose<I1, I2>;
+    return make_layout<NewShape, A::Layout::storage_size, A::Layout::offset>([] {
+        return strides_swap(A::Layout::strides, A::Shape::template normalize_index<I1>(),
+                            A::Shape::template normalize_index<I2>());
+    });
 }
 
 template <Index I1, Index I2, IsTensor A>
 auto _transpose_no_grad(const A& a) {
     PROFILE_SCOPE("_transpose_no_grad");
-    using NewShape = typename A::Shape::template Transpose<I1, I2>;
-
-    Tensor<NewShape, typename A::DType> result;
-
-    constexpr auto idx1 = A::Shape::template normalize_index<I1>();
-    constexpr auto idx2 = A::Shape::template normalize_index<I2>();
-
-#pragma omp parallel for
-    for (Size i = 0; i < A::Shape::flat_size; i++) {
-        auto indices = A::Shape::to_indices(i);
-        std::swap(indices[idx1], indices[idx2]);
-        auto new_idx = NewShape::to_flat_index(indices);
-        result._flat_data()[new_idx] = a.flat_view()[i];
-    }
-
-    return result;
+    return _contiguous_no_grad(_view_no_grad(a, _transpose_layout<I1, I2, A>()));
 }
 
+// Swap two dimensions. The result is a view of a.
 template <Index I1, Index I2, IsTensor A>
 auto transpose(const A& a) {
     PROFILE_SCOPE("transpose");
-    auto raw_result = _transpose_no_grad<I1, I2>(a);
-
-    using NewShape = typename decltype(raw_result)::Shape;
-    using Node =
-        UnaryOpNode<typename A::Node, NewShape, typename A::DType, cx::ProductTermFromShape<typename A::Shape>>;
-
-    return Tensor<NewShape, typename A::DType, Node>{
-        raw_result.get_data(),
-        Node{
-            a.get_node(),
-            [](const auto& dl_df) {
-                PROFILE_SCOPE("transpose::grad");
-                return _transpose_no_grad<I1, I2>(dl_df);
-            },
-        },
-    }
+    return _view(a, _transpose_layout<I1, I2, A>(), [](const auto& dl_df) {
+               PROFILE_SCOPE("transpose::grad");
+               return _transpose_no_grad<I1, I2>(dl_df);
+           })
         .bind_profile(PROFILE_NODE);
 }
 
@@ -173,66 +372,148 @@ template <Index I, IsTensor A>
 auto squeeze(const A& a) {
     PROFILE_SCOPE("squeeze");
     using NewShape = typename A::Shape::template Remove<I>;
-    return reshape<NewShape>(a);
+    constexpr auto idx = A::Shape::template normalize_index<I>();
+    auto layout = make_layout<NewShape, A::Layout::storage_size, A::Layout::offset>(
+        [] { return strides_remove(A::Layout::strides, idx); });
+
+    return _view(a, layout, [](const auto& dl_df) {
+        PROFILE_SCOPE("squeeze::grad");
+        return Tensor<typename A::Shape, typename A::DType>{dl_df.get_data()};
+    });
 }
 
 template <Index I, IsTensor A>
 auto unsqueeze(const A& a) {
     PROFILE_SCOPE("unsqueeze");
     using NewShape = typename A::Shape::template Insert<I, OneDimension>;
-    return reshape<NewShape>(a);
+    constexpr auto idx = [] {
+        if constexpr (I == A::Shape::rank) {
+            return A::Shape::rank;
+        } else {
+            return A::Shape::template normalize_index<I>();
+        }
+    }();
+    // the new dimension's stride doesn't matter (make_layout() canonicalizes it)
+    auto layout = make_layout<NewShape, A::Layout::storage_size, A::Layout::offset>(
+        [] { return strides_insert(A::Layout::strides, idx, 0); });
+
+    return _view(a, layout, [](const auto& dl_df) {
+        PROFILE_SCOPE("unsqueeze::grad");
+        return Tensor<typename A::Shape, typename A::DType>{dl_df.get_data()};
+    });
 }
 
-template <IsTensor A>
-auto _reduce_last(const A& a, auto forward, auto backward) {
-    PROFILE_SCOPE("_reduce_last");
-    using LastDim = typename A::Shape::template At<-1>;
-    using NewShape = typename A::Shape::template Remove<-1>;
-    using Node =
-        UnaryOpNode<typename A::Node, NewShape, typename A::DType, cx::ProductTermFromShape<typename A::Shape>>;
-
-    Tensor<NewShape, typename A::DType, Node> result{Node{
-        a.get_node(),
-        [a, backward](const auto& dl_df) {
-            PROFILE_SCOPE("_reduce_last::grad");
-            Tensor<typename A::Shape, typename A::DType> dl_da;
+// Reducing axis I views a tensor as outer x reduce x inner, so every reduction is the same contiguous loop nest.
+template <IsTensor A, Index I>
+    requires IsValidIndex<typename A::Shape, I>
+struct ReduceShapes {
+    // (must use normalized idx because we change the rank)
+    static constexpr Size idx = A::Shape::template normalize_index<I>();
+    using NewShape = typename A::Shape::template Remove<idx>;
 
-#pragma omp parallel for
-            for (Size i = 0; i < NewShape::flat_size; i++) {
-                std::span<const typename A::DType> slice{a.flat_view().begin() + i * LastDim::value, LastDim::value};
-                auto df_da = backward(slice);  // holds a row
-                for (Size j = 0; j < LastDim::value; j++) {
-                    dl_da._flat_data()[i * LastDim::value + j] = dl_df.flat_view()[i] * df_da[j];
-                }
-            }
+    static constexpr Size reduce = A::Shape::extents[idx];
+    static constexpr Size inner = A::Shape::strides[idx];
+    static constexpr Size outer = A::Shape::flat_size / (reduce * inner);
 
-            return dl_da;
-        },
-    }};
+    // for flat index i into a: the flat index into the result, and the position along the reduced axis
+    static constexpr Size out_index(Size i) { return i / (reduce * inner) * inner + i % inner; }
+    static constexpr Size axis_index(Size i) { return i / inner % reduce; }
+};
 
-#pragma omp parallel for
-    for (Size i = 0; i < NewShape::flat_size; i++) {
-        std::span<const typename A::DType> slice{a.flat_view().begin() + i * LastDim::value, LastDim::value};
-        result._flat_data()[i] = forward(slice);
-    }
+template <Index I, IsTensor A>
+auto _reduce_no_grad(const A& a, typename A::DType init, auto combine) {
+    PROFILE_SCOPE("_reduce_no_grad");
+    using S = ReduceShapes<A, I>;
+    Tensor<typename S::NewShape, typename A::DType> result{uninitialized};
 
-    return result.bind_profile(PROFILE_NODE);
+    auto a_data = a.storage_view().data();
+    kernel::reduce_axis<S::outer, S::reduce, S::inner>(result._flat_data().data(), init, combine,
+                                                       [=](Size i) { return a_data[A::Layout::storage_index(i)]; });
+
+    return result;
+}
+
+// Position of the first maximum along axis I.
+template <Index I, Number DType, IsTensor A>
+auto _argmax_no_grad(const A& a) {
+    PROFILE_SCOPE("_argmax_no_grad");
+    using S = ReduceShapes<A, I>;
+    using Candidate = std::pair<typename A::DType, Size>;  // (value, position along the axis)
+    Tensor<typename S::NewShape, DType> result{uninitialized};
+
+    auto a_data = a.storage_view().data();
+    auto result_data = result._flat_data().data();
+    // recorded as one kernel, since best only lives while it runs
+    _record([=] {
+        kernel::Scratch<Candidate> best{S::NewShape::flat_size};
+        kernel::reduce_axis<S::outer, S::reduce, S::inner>(
+            best.data(), Candidate{std::numeric_limits<typename A::DType>::lowest(), 0},
+            [](Candidate acc, Candidate x) { return x.first > acc.first ? x : acc; },
+            [=](Size i) { return Candidate{a_data[A::Layout::storage_index(i)], S::axis_index(i)}; });
+
+        auto best_data = best.data();
+        kernel::elementwise<S::NewShape::flat_size>([=](Size i) { result_data[i] = best_data[i].second; });
+    });
+
+    return result;
 }
 
+// Reduce axis I with combine(), starting from init. backward(x, y) gives df/dx for an input x that reduced to y.
+// With KeepDim, the result is repeated along axis I as a stride-0 view, so it broadcasts against a for free.
 template <Index I, bool KeepDim, IsTensor A>
     requires IsValidIndex<typename A::Shape, I>
-auto _reduce(const A& a, auto forward, auto backward) {
+auto _reduce(const A& a, typename A::DType init, auto combine, auto backward) {
     PROFILE_SCOPE("_reduce");
-    // pivot index I to the last dimension
-    // (must use normalized idx because we change the rank)
-    constexpr auto idx = A::Shape::template normalize_index<I>();
-    auto b = squeeze<idx>(transpose<idx, -1>(unsqueeze<A::Shape::rank>(a)));
+    using S = ReduceShapes<A, I>;
+    using NewShape = typename S::NewShape;
+    auto raw_result = _reduce_no_grad<I>(a, init, combine);
+
+    // forward mode: the tangents reduce to the sum of the input's, each scaled by the derivative that the grad_fn uses
+    if (auto t_a = _tangent(a)) {
+        auto t_result = _current_tangents->emplace(raw_result);
+        auto a_data = a.storage_view().data();
+        auto y_data = raw_result.flat_view().data();
+        for (Size k = 0; k < _current_tangents->count(); k++) {
+            auto t_a_k = t_a + k * A::Layout::storage_size;
+            kernel::reduce_axis<S::outer, S::reduce, S::inner>(
+                t_result + k * NewShape::flat_size, typename A::DType{0}, [](auto acc, auto t) { return acc + t; },
+                [=](Size i) {
+                    const Size index = A::Layout::storage_index(i);
+                    return backward(a_data[index], y_data[S::out_index(i)]) * t_a_k[index];
+                });
+        }
+    }
 
-    auto reduced = _reduce_last(b, forward, backward);
+    // writes the reduced shape, but reads all of a
+    using Node = UnaryOpNode<typename A::Node, NewShape, typename A::DType, cx::ProductTermFromShape<NewShape>,
+                             cx::ProductTermFromShape<typename A::Shape>>;
+
+    Tensor<NewShape, typename A::DType, Node> reduced{
+        raw_result.get_data(),
+        Node{
+            a.get_node(),
+            [a = a.detach(), y = raw_result.get_data(), backward](const auto& dl_df) {
+                PROFILE_SCOPE("_reduce::grad");
+                Tensor<typename A::Shape, typename A::DType> dl_da{uninitialized};
+
+                auto a_data = a.storage_view().data();
+                auto y_data = y->data();
+                auto dl_df_data = dl_df.flat_view().data();
+                auto dl_da_data = dl_da._flat_data().data();
+                kernel::elementwise<A::Shape::flat_size>([=](Size i) {
+                    const Size out = S::out_index(i);
+                    dl_da_data[i] = dl_df_data[out] * backward(a_data[A::Layout::storage_index(i)], y_data[out]);
+                });
+
+                return dl_da;
+            },
+        },
+    };
+    reduced.bind_profile(PROFILE_NODE);
 
     if constexpr (KeepDim) {
-        using RemovedDim = typename A::Shape::template At<idx>;
-        return repeat<idx, RemovedDim>(unsqueeze<idx>(reduced));
+        using RemovedDim = typename A::Shape::template At<S::idx>;
+        return repeat<S::idx, RemovedDim>(unsqueeze<S::idx>(reduced));
     } else {
         return reduced;
     }
@@ -247,125 +528,249 @@ auto repeat(const A& a) {
     constexpr auto idx = A::Shape::template normalize_index<I>();
 
     using NewShape = typename A::Shape::template Remove<I>::template Insert<idx, Dim>;
-    using Node = UnaryOpNode<typename A::Node, NewShape, typename A::DType, cx::ProductTermFromShape<NewShape>>;
+    auto layout = make_layout<NewShape, A::Layout::storage_size, A::Layout::offset>([] {
+        auto result = A::Layout::strides;
+        result[idx] = 0;
+        return result;
+    });
+
+    // dl/da sums dl/df over the repeated dimension, viewing dl/df as outer x Dim x inner
+    return _view(a, layout, [](const auto& dl_df) {
+               PROFILE_SCOPE("repeat::grad");
+               constexpr Size inner = A::Shape::strides[idx];
+               Tensor<typename A::Shape, typename A::DType> dl_da{uninitialized};
+
+               auto dl_df_data = dl_df.flat_view().data();
+               auto dl_da_data = dl_da._flat_data().data();
+               kernel::elementwise<A::Shape::flat_size>([=](Size i) {
+                   auto row = dl_df_data + (i / inner) * Dim::value * inner + i % inner;
+                   typename A::DType sum = 0;
+                   for (Size j = 0; j < Dim::value; j++) sum += row[j * inner];
+                   dl_da_data[i] = sum;
+               });
+
+               return dl_da;
+           })
+        .bind_profile(PROFILE_NODE);
+}
 
-    Tensor<NewShape, typename A::DType, Node> result{Node{
-        a.get_node(),
-        [a, idx](const auto& dl_df) {
-            PROFILE_SCOPE("repeat::grad");
-            Tensor<typename A::Shape, typename A::DType> dl_da;
+// Shapes involved in matmul(a, b). A has shape .. x M x N and B has shape .. x N x P; the batch dimensions (..)
+// broadcast like in the element-wise ops. Either operand may be a strided view (e.g. a transpose), which the kernel
+// reads in place.
+template <IsTensor A, IsTensor B>
+    requires TensorDTypeCompatible<A, B> && TensorMatmulCompatible<A, B>
+struct MatmulShapes {
+    using M = typename A::Shape::template At<-2>;
+    using N = typename A::Shape::template At<-1>;
+    using P = typename B::Shape::template At<-1>;
 
-#pragma omp parallel for
-            for (Size i = 0; i < A::Shape::flat_size; i++) {
-                typename A::DType dl_da_val = 0;
-
-                auto indices = A::Shape::to_indices(i);
-                for (Size j = 0; j < Dim::value; j++) {
-                    indices[idx] = j;
-                    auto flat_idx = NewShape::to_flat_index(indices);
-                    dl_da_val += dl_df.flat_view()[flat_idx];
-                }
-                dl_da._flat_data()[i] = dl_da_val;
-            }
+    using ABatch = typename A::Shape::template Remove<-1>::template Remove<-1>;
+    using BBatch = typename B::Shape::template Remove<-1>::template Remove<-1>;
+    using Batch = std::conditional_t<(ABatch::rank >= BBatch::rank), ABatch, BBatch>;
+    using OutShape = typename Batch::template Insert<Batch::rank, M>::template Insert<Batch::rank + 1, P>;
 
-            return dl_da;
-        },
-    }};
+    // row and column strides of each operand's matrices
+    static constexpr Size a_rs = A::Layout::strides[A::Shape::rank - 2];
+    static constexpr Size a_cs = A::Layout::strides[A::Shape::rank - 1];
+    static constexpr Size b_rs = B::Layout::strides[B::Shape::rank - 2];
+    static constexpr Size b_cs = B::Layout::strides[B::Shape::rank - 1];
 
-#pragma omp parallel for
-    for (Size i = 0; i < NewShape::flat_size; i++) {
-        auto indices = NewShape::to_indices(i);
-        indices[idx] = 0;
-        auto flat_idx = A::Shape::to_flat_index(indices);
-        result._flat_data()[i] = a.flat_view()[flat_idx];
+    // first element of the matrices used by output batch i
+    static auto a_batch_data(const auto& a, Size i) {
+        return a.storage_view().data() + A::Layout::storage_index(i % ABatch::flat_size * M::value * N::value);
+    }
+    static auto b_batch_data(const auto& b, Size i) {
+        return b.storage_view().data() + B::Layout::storage_index(i % BBatch::flat_size * N::value * P::value);
     }
+};
 
-    return result.bind_profile(PROFILE_NODE);
+template <IsTensor A, IsTensor B>
+    requires TensorDTypeCompatible<A, B> && TensorMatmulCompatible<A, B>
+auto _matmul_no_grad(const A& a, const B& b) {
+    PROFILE_SCOPE("_matmul_no_grad");
+    using S = MatmulShapes<A, B>;
+    constexpr Size M = S::M::value, N = S::N::value, P = S::P::value;
+
+    Tensor<typename S::OutShape, typename A::DType> result{uninitialized};
+
+    for (Size i = 0; i < S::Batch::flat_size; i++) {
+        auto result_data = result._flat_data().data() + i * M * P;
+        kernel::gemm(M, N, P, S::a_batch_data(a, i), S::a_rs, S::a_cs, S::b_batch_data(b, i), S::b_rs, S::b_cs,
+                     result_data, P);
+    }
+
+    return result;
 }
 
 template <IsTensor A, IsTensor B>
     requires TensorDTypeCompatible<A, B> && TensorMatmulCompatible<A, B>
 auto matmul(const A& a, const B& b) {
     PROFILE_SCOPE("matmul");
-    // A has shape .. x M x N
-    // B has shape .. x N x P
-    using M = typename A::Shape::template At<-2>;
-    using N = typename A::Shape::template At<-1>;
-    using P = typename B::Shape::template At<-1>;
-
-    // expand A to .. x M x 1 x N
-    auto c = unsqueeze<-1>(a);
-    // expand A to .. x M x P x N
-    auto d = repeat<-2, P>(c);
+    auto raw_result = _matmul_no_grad(a, b);
+
+    using S = MatmulShapes<A, B>;
+    using NewShape = typename S::OutShape;
+
+    // forward mode: d(a x b) = da x b + a x db, direction by direction
+    auto t_a = _tangent(a);
+    auto t_b = _tangent(b);
+    if (t_a || t_b) {
+        constexpr Size M = S::M::value, N = S::N::value, P = S::P::value;
+        auto t_result = _current_tangents->emplace(raw_result);
+        auto a_data = a.storage_view().data();
+        auto b_data = b.storage_view().data();
+        for (Size k = 0; k < _current_tangents->count(); k++) {
+            for (Size i = 0; i < S::Batch::flat_size; i++) {
+                // the same offsets into the tangents as into the data
+                const auto a_offset = S::a_batch_data(a, i) - a_data;
+                const auto b_offset = S::b_batch_data(b, i) - b_data;
+                auto t_out = t_result + k * NewShape::flat_size + i * M * P;
+                if (t_a) {
+                    kernel::gemm(M, N, P, t_a + k * A::Layout::storage_size + a_offset, S::a_rs, S::a_cs,
+                                 S::b_batch_data(b, i), S::b_rs, S::b_cs, t_out, P);
+                }
+                if (t_b) {
+                    kernel::gemm(M, N, P, S::a_batch_data(a, i), S::a_rs, S::a_cs,
+                                 t_b + k * B::Layout::storage_size + b_offset, S::b_rs, S::b_cs, t_out, P,
+                                 t_a != nullptr);
+                }
+            }
+        }
+    }
+    // writes .. x M x P, but does N multiply-adds per output element
+    using Node = BinaryOpNode<typename A::Node, typename B::Node, NewShape, typename A::DType,
+                              cx::ProductTermFromShape<NewShape>,
+                              cx::ProductTerm<cx::PolyTerm<typename S::N, 1>, cx::ProductTermFromShape<NewShape>>>;
 
-    // transpose B to .. x P x N
-    auto e = transpose<-2, -1>(b);
-    // expand B to .. x 1 x P x N
-    auto f = unsqueeze<-2>(e);
-    // expand B to .. x M x P x N
-    auto g = repeat<-3, M>(f);
+    return Tensor<NewShape, typename A::DType, Node>{
+        raw_result.get_data(),
+        Node{
+            a.get_node(),
+            b.get_node(),
+            [a = a.detach(), b = b.detach()](const auto& dl_df) {
+                PROFILE_SCOPE("matmul::grad");
+                constexpr Size M = S::M::value, N = S::N::value, P = S::P::value;
+
+                typename Node::InGrad1 dl_da{uninitialized};
+                typename Node::InGrad2 dl_db{uninitialized};
+
+                // the transposes are free: the kernel packs b^T and a^T straight from b and a by swapping strides.
+                // batches that a (or b) was broadcast to accumulate into the same slice of its gradient.
+                for (Size i = 0; i < S::Batch::flat_size; i++) {
+                    const Size a_batch = i % S::ABatch::flat_size;
+                    const Size b_batch = i % S::BBatch::flat_size;
+                    auto dl_df_data = dl_df.flat_view().data() + i * M * P;
+
+                    // dl/da = dl/df x b^T
+                    if constexpr (A::requires_grad) {
+                        kernel::gemm(M, P, N, dl_df_data, P, 1, S::b_batch_data(b, i), S::b_cs, S::b_rs,
+                                     dl_da._flat_data().data() + a_batch * M * N, N, i >= S::ABatch::flat_size);
+                    }
+                    // dl/db = a^T x dl/df
+                    if constexpr (B::requires_grad) {
+                        kernel::gemm(N, M, P, S::a_batch_data(a, i), S::a_cs, S::a_rs, dl_df_data, P, 1,
+                                     dl_db._flat_data().data() + b_batch * N * P, P, i >= S::BBatch::flat_size);
+                    }
+                }
 
-    // element-wise multiplication, still .. x M x P x N
-    auto h = d * g;
-    // collapse the last dimension, yielding .. x M x P
-    return sum(h).bind_profile(PROFILE_NODE);
+                return std::make_pair(dl_da, dl_db);
+            },
+        },
+    }
+        .bind_profile(PROFILE_NODE);
 }
 
-template <IsTensor A>
+template <IsOperand A>
 auto operator-(const A& a) {
     PROFILE_SCOPE("operator-::unary");
-    return _unary_op(a, [](auto x) { return -x; }, [](auto x) { return -1; });
+    return _unary_op(a, [](auto x) { return -x; }, [](auto x, auto y) { return -1; });
 }
 
-template <IsFloatTensor A>
+template <IsFloatOperand A>
 auto exp(const A& a) {
     PROFILE_SCOPE("exp");
-    return _unary_op(a, [](auto x) { return std::exp(x); }, [](auto x) { return std::exp(x); });
+    return _unary_op(a, [](auto x) { return kernel::exp(x); }, [](auto x, auto y) { return y; });
 }
 
-template <IsFloatTensor A>
+template <IsFloatOperand A>
 auto log(const A& a) {
     PROFILE_SCOPE("log");
-    return _unary_op(a, [](auto x) { return std::log(x); }, [](auto x) { return 1 / x; });
+    return _unary_op(a, [](auto x) { return kernel::log(x); }, [](auto x, auto y) { return 1 / x; });
 }
 
-template <IsTensor A>
-auto pow(const A& a, typename A::DType b) {
-    PROFILE_SCOPE("pow");
-    return _unary_op(a, [b](auto x) { return std::pow(x, b); }, [b](auto x) { return b * std::pow(x, b - 1); });
-}
-
-template <IsTensor A>
+template <IsOperand A>
 auto sqrt(const A& a) {
     PROFILE_SCOPE("sqrt");
-    return pow(a, 0.5);
+    using DType = typename A::DType;
+    return _unary_op(
+        a, [](auto x) { return static_cast<DType>(std::sqrt(x)); }, [](auto x, auto y) { return DType{1} / (2 * y); });
 }
 
-template <IsFloatTensor A>
+template <IsOperand A>
+auto pow(const A& a, typename A::DType b) {
+    PROFILE_SCOPE("pow");
+    using DType = typename A::DType;
+    if constexpr (IsExpr<A>) {
+        // each fast path below is an expression of a different type, and b is only known at run time
+        return _unary_op(
+            a, [b](auto x) { return std::pow(x, b); }, [b](auto x, auto y) { return b * std::pow(x, b - 1); });
+    } else {
+        // common exponents get loops of their own, which vectorize; std::pow is left for the rest
+        if (b == 2) {
+            return _unary_op(a, [](auto x) { return x * x; }, [](auto x, auto y) { return 2 * x; });
+        }
+        if constexpr (std::floating_point<DType>) {
+            if (b == -1) {
+                return _unary_op(a, [](auto x) { return 1 / x; }, [](auto x, auto y) { return -y * y; });
+            } else if (b == 0.5) {
+                return sqrt(a);
+            } else if (b == -0.5) {
+                return _unary_op(
+                    a, [](auto x) { return 1 / std::sqrt(x); }, [](auto x, auto y) { return DType{-0.5} * y / x; });
+            }
+        }
+        if (b == std::trunc(b) && std::abs(b) <= 64) {
+            const auto n = static_cast<std::int64_t>(b);
+            return _unary_op(
+                a, [n](auto x) { return kernel::ipow(x, n); },
+                [n](auto x, auto y) { return n == 0 ? 0 : n * kernel::ipow(x, n - 1); });
+        }
+        return _unary_op(
+            a, [b](auto x) { return std::pow(x, b); }, [b](auto x, auto y) { return b * std::pow(x, b - 1); });
+    }
+}
+
+template <IsFloatOperand A>
 auto sin(const A& a) {
     PROFILE_SCOPE("sin");
-    return _unary_op(a, [](auto x) { return std::sin(x); }, [](auto x) { return std::cos(x); });
+    return _unary_op(
+        a, [](auto x, auto large) { return kernel::sin<large>(x); },
+        [](auto x, auto y, auto large) { return kernel::cos<large>(x); }, kernel::large_trig_argument);
 }
 
-template <IsFloatTensor A>
+template <IsFloatOperand A>
 auto cos(const A& a) {
     PROFILE_SCOPE("cos");
-    return _unary_op(a, [](auto x) { return std::cos(x); }, [](auto x) { return -std::sin(x); });
+    return _unary_op(
+        a, [](auto x, auto large) { return kernel::cos<large>(x); },
+        [](auto x, auto y, auto large) { return -kernel::sin<large>(x); }, kernel::large_trig_argument);
 }
 
-template <IsFloatTensor A>
+template <IsFloatOperand A>
 auto tan(const A& a) {
     PROFILE_SCOPE("tan");
-    return _unary_op(a, [](auto x) { return std::tan(x); }, [](auto x) { return 1 / std::pow(std::cos(x), 2); });
+    return _unary_op(
+        a, [](auto x, auto large) { return kernel::tan<large>(x); }, [](auto x, auto y) { return 1 + y * y; },
+        kernel::large_trig_argument);
 }
 
-template <IsFloatTensor A>
+template <IsFloatOperand A>
 auto relu(const A& a) {
     PROFILE_SCOPE("relu");
-    return _unary_op(a, [](auto x) { return x > 0 ? x : 0; }, [](auto x) { return x > 0 ? 1 : 0; });
+    return _unary_op(a, [](auto x) { return x > 0 ? x : 0; }, [](auto x, auto y) { return x > 0 ? 1 : 0; });
 }
 
-template <IsTensor A, IsTensor B>
+template <IsOperand A, IsOperand B>
     requires TensorBinaryOpCompatible<A, B>
 auto operator+(const A& a, const B& b) {
     PROFILE_SCOPE("operator+::tensor_tensor");
@@ -373,7 +778,7 @@ auto operator+(const A& a, const B& b) {
         a, b, [](auto x, auto y) { return x + y; }, [](auto x, auto y) { return 1; }, [](auto x, auto y) { return 1; });
 }
 
-template <IsTensor A, IsTensor B>
+template <IsOperand A, IsOperand B>
     requires TensorBinaryOpCompatible<A, B>
 auto operator-(const A& a, const B& b) {
     PROFILE_SCOPE("operator-::tensor_tensor");
@@ -382,7 +787,7 @@ auto operator-(const A& a, const B& b) {
         [](auto x, auto y) { return -1; });
 }
 
-template <IsTensor A, IsTensor B>
+template <IsOperand A, IsOperand B>
     requires TensorBinaryOpCompatible<A, B>
 auto operator*(const A& a, const B& b) {
     PROFILE_SCOPE("operator*::tensor_tensor");
@@ -390,7 +795,7 @@ auto operator*(const A& a, const B& b) {
         a, b, [](auto x, auto y) { return x * y; }, [](auto x, auto y) { return y; }, [](auto x, auto y) { return x; });
 }
 
-template <IsFloatTensor A, IsFloatTensor B>
+template <IsFloatOperand A, IsFloatOperand B>
     requires TensorBinaryOpCompatible<A, B>
 auto operator/(const A& a, const B& b) {
     PROFILE_SCOPE("operator/::tensor_tensor");
@@ -400,7 +805,7 @@ auto operator/(const A& a, const B& b) {
 }
 
 #define DEFINE_COMPARISON_OP(opname, op)                                                           \
-    template <IsTensor A, IsTensor B>                                                              \
+    template <IsOperand A, IsOperand B>                                                            \
         requires TensorBinaryOpCompatible<A, B>                                                    \
     auto opname(const A& a, const B& b) {                                                          \
         PROFILE_SCOPE(#opname);                                                                    \
@@ -425,81 +830,103 @@ auto where(const Cond& cond, const A& a, const B& b) {
     using Node = BinaryOpNode<typename A::Node, typename B::Node, typename A::Shape, typename A::DType,
                               cx::ProductTermFromShape<typename A::Shape>>;
 
-    Tensor<typename A::Shape, typename A::DType, Node> result{Node{
+    Tensor<typename A::Shape, typename A::DType, Node> result{uninitialized, Node{
         a.get_node(),
         b.get_node(),
-        [cond, a, b](const auto& dl_df) {
+        [cond = cond.detach(), a = a.detach(), b = b.detach()](const auto& dl_df) {
             PROFILE_SCOPE("where::grad");
-            Tensor<typename A::Shape, typename A::DType> dl_da;
-            Tensor<typename B::Shape, typename B::DType> dl_db;
-
-#pragma omp parallel
-            for (Size i = 0; i < A::Shape::flat_size; i++) {
-                if (cond.flat_view()[i]) {
-                    dl_da._flat_data()[i] = dl_df.flat_view()[i];
-                } else {
-                    dl_db._flat_data()[i] = dl_df.flat_view()[i];
-                }
-            }
+            typename Node::InGrad1 dl_da{uninitialized};
+            typename Node::InGrad2 dl_db{uninitialized};
+
+            auto cond_data = cond.storage_view().data();
+            auto dl_df_data = dl_df.flat_view().data();
+            auto dl_da_data = _grad_data<typename A::DType>(dl_da);
+            auto dl_db_data = _grad_data<typename B::DType>(dl_db);
+            kernel::elementwise<A::Shape::flat_size>([=](Size i) {
+                auto c = cond_data[Cond::Layout::storage_index(i)];
+                if constexpr (A::requires_grad) dl_da_data[i] = c ? dl_df_data[i] : 0;
+                if constexpr (B::requires_grad) dl_db_data[i] = c ? 0 : dl_df_data[i];
+            });
 
             return std::make_pair(dl_da, dl_db);
         },
     }};
 
-#pragma omp parallel
-    for (Size i = 0; i < A::Shape::flat_size; i++) {
-        result._flat_data()[i] = cond.flat_view()[i] ? a.flat_view()[i] : b.flat_view()[i];
+    auto cond_data = cond.storage_view().data();
+    auto a_data = a.storage_view().data();
+    auto b_data = b.storage_view().data();
+    auto result_data = result._flat_data().data();
+    kernel::elementwise<A::Shape::flat_size>([=](Size i) {
+        result_data[i] = cond_data[Cond::Layout::storage_index(i)] ? a_data[A::Layout::storage_index(i)]
+                                                                   : b_data[B::Layout::storage_index(i)];
+    });
+
+    // forward mode: the tangents of the chosen operand
+    auto t_a = _tangent(a);
+    auto t_b = _tangent(b);
+    if (t_a || t_b) {
+        auto t_result = _current_tangents->emplace(result);
+        const Size count = _current_tangents->count();
+        kernel::elementwise<A::Shape::flat_size>([=](Size i) {
+            const bool c = cond_data[Cond::Layout::storage_index(i)];
+            const auto t_chosen = c ? t_a : t_b;
+            const Size index = c ? A::Layout::storage_index(i) : B::Layout::storage_index(i);
+            const Size stride = c ? A::Layout::storage_size : B::Layout::storage_size;
+            for (Size k = 0; k < count; k++) {
+                t_result[k * A::Shape::flat_size + i] = t_chosen ? t_chosen[k * stride + index] : 0;
+            }
+        });
     }
 
     return result.bind_profile(PROFILE_NODE);
 }
 
-template <IsTensor A>
+template <IsOperand A>
 auto operator+(const A& a, typename A::DType b) {
     PROFILE_SCOPE("operator+::tensor_scalar");
-    return _unary_op(a, [b](auto x) { return x + b; }, [](auto x) { return 1; });
+    return _unary_op(a, [b](auto x) { return x + b; }, [](auto x, auto y) { return 1; });
 }
 
-template <IsTensor B>
+template <IsOperand B>
 auto operator+(typename B::DType a, const B& b) {
     PROFILE_SCOPE("operator+::scalar_tensor");
-    return _unary_op(b, [a](auto x) { return a + x; }, [](auto x) { return 1; });
+    return _unary_op(b, [a](auto x) { return a + x; }, [](auto x, auto y) { return 1; });
 }
 
-template <IsTensor A>
+template <IsOperand A>
 auto operator-(const A& a, typename A::DType b) {
     PROFILE_SCOPE("operator-::tensor_scalar");
-    return _unary_op(a, [b](auto x) { return x - b; }, [](auto x) { return 1; });
+    return _unary_op(a, [b](auto x) { return x - b; }, [](auto x, auto y) { return 1; });
 }
 
-template <IsTensor B>
+template <IsOperand B>
 auto operator-(typename B::DType a, const B& b) {
     PROFILE_SCOPE("operator-::scalar_tensor");
-    return _unary_op(b, [a](auto x) { return a - x; }, [](auto x) { return -1; });
+    return _unary_op(b, [a](auto x) { return a - x; }, [](auto x, auto y) { return -1; });
 }
 
-template <IsTensor A>
+template <IsOperand A>
 auto operator*(const A& a, typename A::DType b) {
     PROFILE_SCOPE("operator*::tensor_scalar");
-    return _unary_op(a, [b](auto x) { return x * b; }, [b](auto x) { return b; });
+    return _unary_op(a, [b](auto x) { return x * b; }, [b](auto x, auto y) { return b; });
 }
 
-template <IsTensor B>
+template <IsOperand B>
 auto operator*(typename B::DType a, const B& b) {
     PROFILE_SCOPE("operator*::scalar_tensor");
-    return _unary_op(b, [a](auto x) { return a * x; }, [a](auto x) { return a; });
+    return _unary_op(b, [a](auto x) { return a * x; }, [a](auto x, auto y) { return a; });
 }
 
-template <IsFloatTensor A>
+template <IsFloatOperand A>
 auto operator/(const A& a, typename A::DType b) {
     PROFILE_SCOPE("operator/::tensor_scalar");
-    return _unary_op(a, [b](auto x) { return x / b; }, [b](auto x) { return 1 / b; });
+    return _unary_op(a, [b](auto x) { return x / b; }, [b](auto x, auto y) { return 1 / b; });
 }
 
-template <IsFloatTensor B>
+template <IsFloatOperand B>
 auto operator/(typename B::DType a, const B& b) {
     PROFILE_SCOPE("operator/::scalar_tensor");
-    return _unary_op(b, [a](auto x) { return a / x; }, [a](auto x) { return -a / (x * x); });
+    return _unary_op(b, [a](auto x) { return a / x; }, [a](auto x, auto y) { return -a / (x * x); });
 }
 
 template <Index I = -1, bool KeepDim = false, IsTensor A>
@@ -507,18 +934,7 @@ template <Index I = -1, bool KeepDim = false, IsTensor A>
 auto sum(const A& a) {
     PROFILE_SCOPE("sum");
     return _reduce<I, KeepDim>(
-        a,
-        [](auto x) {
-            typename A::DType sum = 0;
-            for (auto i : x) sum += i;
-            return sum;
-        },
-        [](auto x) {
-            using Dim = typename A::Shape::template At<I>;
-            std::array<typename A::DType, Dim::value> row;
-            row.fill(1);
-            return row;
-        });
+        a, 0, [](auto acc, auto x) { return acc + x; }, [](auto x, auto y) { return 1; });
 }
 
 template <Index I = -1, bool KeepDim = false, IsTensor A>
@@ -526,22 +942,7 @@ template <Index I = -1, bool KeepDim = false, IsTensor A>
 auto prod(const A& a) {
     PROFILE_SCOPE("prod");
     return _reduce<I, KeepDim>(
-        a,
-        [](std::span<const typename A::DType> x) {
-            typename A::DType prod = 1;
-            for (auto i : x) prod *= i;
-            return prod;
-        },
-        [](auto x) {
-            using Dim = typename A::Shape::template At<I>;
-            typename A::DType prod = 1;
-            for (auto i : x) prod *= i;
-            std::array<typename A::DType, Dim::value> row;
-            for (Size i = 0; i < Dim::value; i++) {
-                row[i] = prod / x[i];
-            }
-            return row;
-        });
+        a, 1, [](auto acc, auto x) { return acc * x; }, [](auto x, auto y) { return y / x; });
 }
 
 // numerically stable, unlike log(sum(exp(x))).
@@ -565,21 +966,63 @@ auto mean(const A& a) {
     return sum<I, KeepDim>(a) / SumDim::value;
 }
 
+// Like argmax, only the first maximal element along the axis receives gradient.
 template <Index I = -1, bool KeepDim = false, IsTensor A>
     requires IsValidIndex<typename A::Shape, I>
 auto max(const A& a) {
     PROFILE_SCOPE("max");
-    return _reduce<I, KeepDim>(
-        a, [](auto x) { return *std::max_element(x.begin(), x.end()); },
-        [](auto x) {
-            // all 0s except 1 at the max element
-            using Dim = typename A::Shape::template At<I>;
-            std::array<typename A::DType, Dim::value> row;
-            row.fill(0);
-            auto max_it = std::max_element(x.begin(), x.end());
-            row[std::distance(x.begin(), max_it)] = 1;
-            return row;
+    using S = ReduceShapes<A, I>;
+    using NewShape = typename S::NewShape;
+    auto raw_result = _reduce_no_grad<I>(a, std::numeric_limits<typename A::DType>::lowest(),
+                                         [](auto acc, auto x) { return x > acc ? x : acc; });
+
+    // forward mode: the tangents of the first maximal element
+    if (auto t_a = _tangent(a)) {
+        auto t_result = _current_tangents->emplace(raw_result);
+        const Size count = _current_tangents->count();
+        auto arg = _argmax_no_grad<I, Size>(a);
+        auto arg_data = arg.flat_view().data();
+        kernel::elementwise<NewShape::flat_size>([=](Size out) {
+            const Size i = (out / S::inner * S::reduce + arg_data[out]) * S::inner + out % S::inner;
+            const Size index = A::Layout::storage_index(i);
+            for (Size k = 0; k < count; k++) {
+                t_result[k * NewShape::flat_size + out] = t_a[k * A::Layout::storage_size + index];
+            }
         });
+    }
+
+    using Node = UnaryOpNode<typename A::Node, NewShape, typename A::DType, cx::ProductTermFromShape<NewShape>,
+                             cx::ProductTermFromShape<typename A::Shape>>;
+
+    Tensor<NewShape, typename A::DType, Node> reduced{
+        raw_result.get_data(),
+        Node{
+            a.get_node(),
+            [a = a.detach()](const auto& dl_df) {
+                PROFILE_SCOPE("max::grad");
+                Tensor<typename A::Shape, typename A::DType> dl_da{uninitialized};
+
+                auto arg = _argmax_no_grad<I, Size>(a);
+                auto arg_data = arg.flat_view().data();
+                auto dl_df_data = dl_df.flat_view().data();
+                auto dl_da_data = dl_da._flat_data().data();
+                kernel::elementwise<A::Shape::flat_size>([=](Size i) {
+                    const Size out = S::out_index(i);
+                    dl_da_data[i] = arg_data[out] == S::axis_index(i) ? dl_df_data[out] : 0;
+                });
+
+                return dl_da;
+            },
+        },
+    };
+    reduced.bind_profile(PROFILE_NODE);
+
+    if constexpr (KeepDim) {
+        using RemovedDim = typename A::Shape::template At<S::idx>;
+        return repeat<S::idx, RemovedDim>(unsqueeze<S::idx>(reduced));
+    } else {
+        return reduced;
+    }
 }
 
 template <Index I = -1, bool KeepDim = false, IsTensor A>
@@ -589,33 +1032,11 @@ auto min(const A& a) {
     return -max<I, KeepDim>(-a);
 }
 
-template <Number DType, IsTensor A>
-auto _argmax_last(const A& a) {
-    PROFILE_SCOPE("_argmax_last");
-    using LastDim = typename A::Shape::template At<-1>;
-    using NewShape = typename A::Shape::template Remove<-1>;
-
-    Tensor<NewShape, DType> result;
-
-#pragma omp parallel for
-    for (Size i = 0; i < NewShape::flat_size; i++) {
-        std::span<const typename A::DType> slice{a.flat_view().begin() + i * LastDim::value, LastDim::value};
-        auto max_it = std::max_element(slice.begin(), slice.end());
-        result._flat_data()[i] = std::distance(slice.begin(), max_it);
-    }
-
-    return result;
-}
-
 template <Index I = -1, IsTensor A, Number DType = typename A::DType>
     requires IsValidIndex<typename A::Shape, I>
 auto argmax(const A& a) {
     PROFILE_SCOPE("argmax");
-    // pivot index I to the last dimension
-    // (must use normalized idx because we change the rank)
-    constexpr auto idx = A::Shape::template normalize_index<I>();
-    auto b = squeeze<idx>(transpose<idx, -1>(unsqueeze<A::Shape::rank>(a)));
-    return _argmax_last<DType>(b);
+    return _argmax_no_grad<I, DType>(a);
 }
 
 template <Index I = -1, IsTensor A, Number DType = typename A::DType>
@@ -631,16 +1052,21 @@ auto one_hot(const A& a) {
     PROFILE_SCOPE("one_hot");
     using NewShape = typename A::Shape::template Insert<A::Shape::rank, Classes>;
 
-    Tensor<NewShape, DType> result;
+    Tensor<NewShape, DType> result{uninitialized};
 
+    auto a_data = a.storage_view().data();
+    auto result_data = result._flat_data().data();
+    _record([=] {
+        std::fill_n(result_data, NewShape::flat_size, DType{0});
 #pragma omp parallel for
-    for (Size i = 0; i < A::Shape::flat_size; i++) {
-        auto cur_class = a.flat_view()[i];
-        if (cur_class >= Classes::value) {
-            throw std::invalid_argument("class index out of range");
+        for (Size i = 0; i < A::Shape::flat_size; i++) {
+            auto cur_class = a_data[A::Layout::storage_index(i)];
+            if (cur_class >= Classes::value) {
+                throw std::invalid_argument("class index out of range");
+            }
+            result_data[i * Classes::value + cur_class] = 1;
         }
-        result._flat_data()[i * Classes::value + cur_class] = 1;
-    }
+    });
 
     return result;
 }
@@ -665,15 +1091,110 @@ auto log_softmax(const A& a) {
     return a - logsumexp<I, true>(a);
 }
 
+// Mean over the last axis of target of -log_softmax(logits)[target], computed row by row without building the
+// log-probabilities or a one-hot target. Each row is read once, keeping a running max and sum of exponentials.
 template <IsTensor Logits, IsTensor Target>
+    requires IsIntegralTensor<Target> && (Target::Shape::rank > 0) &&
+             std::is_same_v<typename Logits::Shape::template Remove<-1>, typename Target::Shape>
 auto cross_entropy(const Logits& logits, const Target& target) {
     PROFILE_SCOPE("cross_entropy");
-    // from https://ml-cheatsheet.readthedocs.io/en/latest/loss_functions.html
-    using Classes = typename Logits::Shape::template At<-1>;
-    auto log_probs = log_softmax(logits);
-    auto one_hot_target = one_hot<Classes, Target, typename Logits::DType>(target);
-    auto per_input_cross_entropy = -sum(one_hot_target * log_probs);
-    return mean(per_input_cross_entropy).bind_profile(PROFILE_NODE);
+    using DType = typename Logits::DType;
+    using NewShape = typename Target::Shape::template Remove<-1>;
+    constexpr Size rows = Target::Shape::flat_size;
+    constexpr Size classes = Logits::Shape::template At<-1>::value;
+    constexpr Size batch = Target::Shape::template At<-1>::value;  // rows averaged into each output
+
+    // log(sum(exp(x))) of each row
+    Tensor<typename Target::Shape, DType> raw_lse{uninitialized};
+    Tensor<NewShape, DType> raw_result{uninitialized};
+    auto x_data = logits.storage_view().data();
+    auto target_data = target.storage_view().data();
+    auto lse_data = raw_lse._flat_data().data();
+    auto result_data = raw_result._flat_data().data();
+
+    _record([=] {
+        for (Size row = 0; row < rows; row++) {
+            const auto cls = target_data[Target::Layout::storage_index(row)];
+            if (cls < 0 || static_cast<Size>(cls) >= classes) {
+                throw std::invalid_argument("class index out of range");
+            }
+        }
+
+#pragma omp parallel for schedule(static) if (Logits::Shape::flat_size > kernel::grain_size)
+        for (Size row = 0; row < rows; row++) {
+            DType max_x = std::numeric_limits<DType>::lowest();
+            DType sum_exp = 0;
+            for (Size c = 0; c < classes; c++) {
+                const DType x = x_data[Logits::Layout::storage_index(row * classes + c)];
+                if (x > max_x) {
+                    sum_exp = sum_exp * kernel::exp(max_x - x) + 1;
+                    max_x = x;
+                } else {
+                    sum_exp += kernel::exp(x - max_x);
+                }
+            }
+            lse_data[row] = max_x + kernel::log(sum_exp);
+        }
+
+        kernel::reduce_axis<NewShape::flat_size, batch, 1>(
+            result_data, DType{0}, [](DType acc, DType x) { return acc + x; },
+            [=](Size row) {
+                const Size cls = target_data[Target::Layout::storage_index(row)];
+                return lse_data[row] - x_data[Logits::Layout::storage_index(row * classes + cls)];
+            });
+        for (Size i = 0; i < NewShape::flat_size; i++) result_data[i] /= batch;
+    });
+
+    // forward mode: each row's loss moves by (softmax(x) - one_hot(target)) . dx, averaged like the loss
+    if (auto t_x = _tangent(logits)) {
+        auto t_result = _current_tangents->emplace(raw_result);
+        for (Size k = 0; k < _current_tangents->count(); k++) {
+            auto t_x_k = t_x + k * Logits::Layout::storage_size;
+            kernel::reduce_axis<NewShape::flat_size, batch, 1>(
+                t_result + k * NewShape::flat_size, DType{0}, [](DType acc, DType t) { return acc + t; },
+                [=](Size row) {
+                    const Size cls = target_data[Target::Layout::storage_index(row)];
+                    DType t = 0;
+                    for (Size c = 0; c < classes; c++) {
+                        const Size index = Logits::Layout::storage_index(row * classes + c);
+                        t += (kernel::exp(x_data[index] - lse_data[row]) - (c == cls)) * t_x_k[index];
+                    }
+                    return t / batch;
+                });
+        }
+    }
+
+    // keeps the log-sum-exp of every row; reads every logit
+    using Node = UnaryOpNode<typename Logits::Node, NewShape, DType, cx::ProductTermFromShape<typename Target::Shape>,
+                             cx::ProductTermFromShape<typename Logits::Shape>>;
+
+    return Tensor<NewShape, DType, Node>{
+        raw_result.get_data(),
+        Node{
+            logits.get_node(),
+            [logits = logits.detach(), target = target.detach(), lse = raw_lse.get_data()](const auto& dl_df) {
+                PROFILE_SCOPE("cross_entropy::grad");
+                // d/dx of the row's loss is softmax(x) - one_hot(target), scaled by 1 / batch
+                Tensor<typename Logits::Shape, DType> dl_dx{uninitialized};
+
+                auto x_data = logits.storage_view().data();
+                auto lse_data = lse->data();
+                auto target_data = target.storage_view().data();
+                auto dl_df_data = dl_df.flat_view().data();
+                auto dl_dx_data = dl_dx._flat_data().data();
+                kernel::elementwise<Logits::Shape::flat_size>([=](Size i) {
+                    const Size row = i / classes;
+                    const Size c = i % classes;
+                    const DType softmax = kernel::exp(x_data[Logits::Layout::storage_index(i)] - lse_data[row]);
+                    const DType hit = static_cast<Size>(target_data[Target::Layout::storage_index(row)]) == c;
+                    dl_dx_data[i] = dl_df_data[row / batch] / batch * (softmax - hit);
+                });
+
+                return dl_dx;
+            },
+        },
+    }
+        .bind_profile(PROFILE_NODE);
 }
 
 }  // namespace vgrad
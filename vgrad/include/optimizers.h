@@ -1,39 +1,105 @@
 #ifndef VGRAD_OPTIMIZERS_H_
 #define VGRAD_OPTIMIZERS_H_
 
+#include <cmath>
+
 #include "backward.h"
+#include "elementwise.h"
+#include "flat_params.h"
+#include "forward.h"
+#include "micro_batch.h"
 
 namespace vgrad::optim {
 
+// Optimizers update the parameters in place, without building graph nodes. Tensors sharing a parameter's buffer see the
+// update too. Given a FlatParams, they compute the gradients into its buffer and update all the parameters in one pass.
 template <IsTensor... Params>
-    requires(IsFloatTensor<Params> && ...)
+    requires(IsFloatTensor<Params> && ...) && (Params::requires_grad && ...) && IsFlattenable<Params...>
 class SGD {
    public:
     SGD(const float lr, Params&... params) : SGD(lr, std::make_tuple(std::ref(params)...)) {}
 
     SGD(const float lr, std::tuple<Params&...> params) : lr_{lr}, params_{params} {}
 
+    SGD(const float lr, FlatParams<Params...>& flat) : lr_{lr}, params_{flat.params()}, flat_{&flat} {}
+
     template <IsScalarTensor Loss>
         requires IsFloatTensor<Loss>
     void step(const Loss& loss) {
         PROFILE_SCOPE("SGD::step");
 
-        auto grads_tuple = std::apply([&loss](auto&... params) { return backward(loss, params...); }, params_);
+        if (flat_) {
+            flat_->backward(loss);
+            update<FlatParams<Params...>::size>(flat_->data(), flat_->grad_data());
+            return;
+        }
+
+        apply(std::apply([&loss](auto&... params) { return backward(loss, params...); }, params_));
+    }
+
+    // Like step(loss_fn()), but the gradients come from forward mode (see forward_grad()), which keeps no graph. Suits
+    // models with few parameters. Returns the loss.
+    template <typename LossFn>
+    auto step_forward(const LossFn& loss_fn) {
+        PROFILE_SCOPE("SGD::step_forward");
+
+        if (flat_) {
+            auto loss = flat_->forward_grad(loss_fn);
+            update<FlatParams<Params...>::size>(flat_->data(), flat_->grad_data());
+            return loss;
+        }
+
+        auto [loss, grads_tuple] =
+            std::apply([&loss_fn](auto&... params) { return forward_grad(loss_fn, params...); }, params_);
+        apply(grads_tuple);
+        return loss;
+    }
+
+    // Like step() over a whole batch, but the gradients are accumulated one micro-batch at a time, so that memory
+    // peaks at what a single micro-batch needs (see micro_batch_grad_to()). Returns the mean loss.
+    template <IsMicroBatches Batches, typename LossFn>
+    auto step_micro_batches(const Batches& batches, const LossFn& loss_fn) {
+        PROFILE_SCOPE("SGD::step_micro_batches");
+        if (flat_) {
+            auto loss = flat_->micro_batch_grad(batches, loss_fn);
+            update<FlatParams<Params...>::size>(flat_->data(), flat_->grad_data());
+            return loss;
+        }
+
+        auto [loss, grads_tuple] = std::apply(
+            [&](auto&... params) { return micro_batch_grad(batches, loss_fn, params...); }, params_);
+        apply(grads_tuple);
+        return loss;
+    }
+
+   private:
+    const float lr_;
+    std::tuple<Params&...> params_;
+    FlatParams<Params...>* flat_ = nullptr;
 
+    // update each parameter with its gradient
+    void apply(const auto& grads_tuple) const {
         std::apply(
             [&](auto&... params) {
-                std::apply([&](auto&... grads) { ((params = (params - lr_ * grads).detach()), ...); }, grads_tuple);
+                std::apply(
+                    [&](const auto&... grads) {
+                        (update<Params::Shape::flat_size>(params._flat_data().data(), grads.flat_view().data()), ...);
+                    },
+                    grads_tuple);
             },
             params_);
     }
 
-   private:
-    const float lr_;
-    std::tuple<Params&...> params_;
+    // w <- w - lr * g, in place
+    template <Size Count, Number DType>
+    void update(DType* w, const DType* g) const {
+        const DType lr = lr_;
+        kernel::elementwise<Count>([=](Size i) { w[i] -= lr * g[i]; });
+    }
 };
 
 template <IsTensor... Params>
-    requires(IsFloatTensor<Params> && ...)
+    requires(IsFloatTensor<Params> && ...) && (Params::requires_grad && ...) && IsFlattenable<Params...>
 class Adam {
    public:
     Adam(const float lr, Params&... params) : Adam(lr, std::make_tuple(std::ref(params)...)) {}
@@ -41,77 +107,133 @@ class Adam {
     // default parameters from https://pytorch.org/docs/stable/generated/torch.optim.Adam.html
     Adam(const float lr, std::tuple<Params&...> params) : Adam(lr, 0.9, 0.999, 1e-8, params) {}
 
+    Adam(const float lr, FlatParams<Params...>& flat) : Adam(lr, 0.9, 0.999, 1e-8, flat) {}
+
     Adam(const float lr, const float beta1, const float beta2, const float eps, Params&... params)
         : Adam(lr, beta1, beta2, eps, std::make_tuple(std::ref(params)...)) {}
 
     Adam(const float lr, const float beta1, const float beta2, const float eps, std::tuple<Params&...> params)
-        : lr_{lr},
-          beta1_{beta1},
-          beta2_{beta2},
-          eps_{eps},
-          params_{params},
-          t_{1},
-          m_{std::apply([](auto&... params) { return std::make_tuple((zeros_like(params))...); }, params_)},
-          v_{std::apply([](auto&... params) { return std::make_tuple((zeros_like(params))...); }, params_)} {}
+        : Adam(lr, beta1, beta2, eps, params, nullptr) {}
+
+    Adam(const float lr, const float beta1, const float beta2, const float eps, FlatParams<Params...>& flat)
+        : Adam(lr, beta1, beta2, eps, flat.params(), &flat) {}
 
     template <IsScalarTensor Loss>
         requires IsFloatTensor<Loss>
     void step(const Loss& loss) {
         PROFILE_SCOPE("Adam::step");
         // implementation of https://pytorch.org/docs/stable/generated/torch.optim.Adam.html
+        advance();
+
+        if (flat_) {
+            flat_->backward(loss);
+            update_flat();
+            return;
+        }
 
         // g <- dL/dw
-        auto g_ = std::apply([&loss](auto&... params) { return backward(loss, params...); }, params_);
+        apply(std::apply([&loss](auto&... params) { return backward(loss, params...); }, params_));
+    }
 
-        // m <- beta1 * m + (1 - beta1) * g
-        std::apply(
-            [&](auto&... m) {
-                std::apply([&](auto&... g) { ((m = (beta1_ * m + (1 - beta1_) * g).detach()), ...); }, g_);
-            },
-            m_);
+    // Like step(loss_fn()), but the gradients come from forward mode (see forward_grad()), which keeps no graph. Suits
+    // models with few parameters. Returns the loss.
+    template <typename LossFn>
+    auto step_forward(const LossFn& loss_fn) {
+        PROFILE_SCOPE("Adam::step_forward");
+        advance();
 
-        // v <- beta2 * v + (1 - beta2) * g^2
-        std::apply(
-            [&](auto&... v) {
-                std::apply([&](auto&... g) { ((v = (beta2_ * v + (1 - beta2_) * g * g).detach()), ...); }, g_);
-            },
-            v_);
+        if (flat_) {
+            auto loss = flat_->forward_grad(loss_fn);
+            update_flat();
+            return loss;
+        }
 
-        // m_hat <- m / (1 - beta1^t)
-        auto m_hat = std::apply(
-            [&](auto&... m) {
-                auto denom = 1 - std::pow(beta1_, t_);
-                return std::make_tuple((m / denom).detach()...);
-            },
-            m_);
+        auto [loss, grads_tuple] =
+            std::apply([&loss_fn](auto&... params) { return forward_grad(loss_fn, params...); }, params_);
+        apply(grads_tuple);
+        return loss;
+    }
 
-        // v_hat <- v / (1 - beta2^t)
-        auto v_hat = std::apply(
-            [&](auto&... v) {
-                auto denom = 1 - std::pow(beta2_, t_);
-                return std::make_tuple((v / denom).detach()...);
-            },
-            v_);
+    // Like step() over a whole batch, but the gradients are accumulated one micro-batch at a time, so that memory
+    // peaks at what a single micro-batch needs (see micro_batch_grad_to()). Returns the mean loss.
+    template <IsMicroBatches Batches, typename LossFn>
+    auto step_micro_batches(const Batches& batches, const LossFn& loss_fn) {
+        PROFILE_SCOPE("Adam::step_micro_batches");
+        advance();
+
+        if (flat_) {
+            auto loss = flat_->micro_batch_grad(batches, loss_fn);
+            update_flat();
+            return loss;
+        }
+
+        auto [loss, grads_tuple] = std::apply(
+            [&](auto&... params) { return micro_batch_grad(batches, loss_fn, params...); }, params_);
+        apply(grads_tuple);
+        return loss;
+    }
+
+   private:
+    using FlatBuffer = std::shared_ptr<typename FlatParams<Params...>::Buffer>;
+
+    // bias corrections, folded into the step size and the scale of sqrt(v); recorded, so that every replay of a
+    // captured step advances t
+    void advance() {
+        _record([this] {
+            step_size_ = lr_ / (1 - std::pow(beta1_, t_));
+            v_scale_ = 1 / std::sqrt(1 - std::pow(beta2_, t_));
+            t_++;
+        });
+    }
 
-        // w <- w - lr * m_hat / (sqrt(v_hat) + eps)
+    void update_flat() {
+        update<FlatParams<Params...>::size>(flat_->data(), flat_->grad_data(), m_flat_->data.data(),
+                                            v_flat_->data.data());
+    }
+
+    // update each parameter, and its moments, with its gradient
+    void apply(const auto& grads_tuple) {
         std::apply(
             [&](auto&... params) {
                 std::apply(
-                    [&](auto&... m_hat) {
+                    [&](const auto&... g) {
                         std::apply(
-                            [&](auto&... v_hat) {
-                                ((params = (params - lr_ * m_hat / (sqrt(v_hat) + eps_)).detach()), ...);
+                            [&](auto&... m) {
+                                std::apply(
+                                    [&](auto&... v) {
+                                        (update<Params::Shape::flat_size>(params._flat_data().data(),
+                                                                          g.flat_view().data(), m._flat_data().data(),
+                                                                          v._flat_data().data()),
+                                         ...);
+                                    },
+                                    v_);
                             },
-                            v_hat);
+                            m_);
                     },
-                    m_hat);
+                    grads_tuple);
             },
             params_);
+    }
+
+    Adam(const float lr, const float beta1, const float beta2, const float eps, std::tuple<Params&...> params,
+         FlatParams<Params...>* flat)
+        : lr_{lr},
+          beta1_{beta1},
+          beta2_{beta2},
+          eps_{eps},
+          params_{params},
+          t_{1},
+          flat_{flat},
+          m_flat_{flat ? flat->make_buffer() : nullptr},
+          v_flat_{flat ? flat->make_buffer() : nullptr},
+          m_{make_moment(m_flat_)},
+          v_{make_moment(v_flat_)} {}
 
-        t_++;
+    auto make_moment(const FlatBuffer& buffer) const {
+        if (buffer) return FlatParams<Params...>::views(buffer);
+        return std::apply([](auto&... params) { return std::make_tuple((zeros_like(params))...); }, params_);
     }
 
-   private:
     const float lr_;
     const float beta1_;
     const float beta2_;
@@ -122,12 +244,44 @@ class Adam {
 
     // iteration counter
     int t_;
+    // bias corrections of the current step
+    double step_size_ = 0;
+    double v_scale_ = 0;
+    // flat buffers behind m_ and v_, if the parameters are flat
+    FlatParams<Params...>* flat_;
+    FlatBuffer m_flat_;
+    FlatBuffer v_flat_;
     // first moment
     std::tuple<typename Params::Detached...> m_;
     // second moment
     std::tuple<typename Params::Detached...> v_;
+
+    // m <- beta1 * m + (1 - beta1) * g
+    // v <- beta2 * v + (1 - beta2) * g^2
+    // w <- w - step_size * m / (sqrt(v) * v_scale + eps)
+    // in one pass, updating w, m and v in place. Recorded as a whole, so that replays read the step's own step_size_
+    // and v_scale_.
+    template <Size Count, Number DType>
+    void update(DType* w_data, const DType* g_data, DType* m_data, DType* v_data) const {
+        _record([=, this] {
+            const DType beta1 = beta1_;
+            const DType beta2 = beta2_;
+            const DType eps = eps_;
+            const DType step = step_size_;
+            const DType scale = v_scale_;
+
+            kernel::elementwise<Count>([=](Size i) {
+                const DType g = g_data[i];
+                const DType m = beta1 * m_data[i] + (1 - beta1) * g;
+                const DType v = beta2 * v_data[i] + (1 - beta2) * g * g;
+                m_data[i] = m;
+                v_data[i] = v;
+                w_data[i] -= step * m / (std::sqrt(v) * scale + eps);
+            });
+        });
+    }
 };
 
 }  // namespace vgrad::optim
 
-#endif  // VGRAD_OPTIMIZERS_H_
\ No newline at end of file
+#endif  // VGRAD_OPTIMIZERS_H_
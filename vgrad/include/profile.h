@@ -1,9 +1,12 @@
 #ifndef VGRAD_PROFILE_H_
 #define VGRAD_PROFILE_H_
 
+#include <atomic>
 #include <chrono>
+#include <cstddef>
 #include <functional>
 #include <iostream>
+#include <thread>
 #include <vector>
 
 #define PROFILE_SCOPE(label) auto _profile_scope = vgrad::profile::_global_profile_instance.profile_scope(label)
@@ -60,11 +63,29 @@ class AutoScopeProfiler {
     const std::function<void()> on_exit_scope;
 };
 
+// kept by the caching allocator (see allocator.h), across all threads
+struct AllocatorCounters {
+    // allocations served from the cache, and from the heap
+    std::atomic<std::size_t> hits{0};
+    std::atomic<std::size_t> misses{0};
+    // bytes sitting in the cache, freed but not returned to the heap
+    std::atomic<std::size_t> bytes_cached{0};
+};
+
+inline AllocatorCounters allocator_counters;
+
 class ProfileInstance {
    public:
     ProfileInstance(std::ostream& os) : os{os} {}
 
     AutoScopeProfiler profile_scope(const std::string label) {
+        // only the thread that created the profile records into it; scopes on other threads (e.g. the tasks of a
+        // parallel backward pass) go to a scratch node of their own
+        if (std::this_thread::get_id() != owner) {
+            thread_local ProfileNode scratch{"", nullptr};
+            return AutoScopeProfiler(&scratch, [] { scratch.hooks.clear(); });
+        }
+
         current->children.emplace_back(label, current);
         current = &current->children.back();
         ProfileNode* enter_scope_node = current;
@@ -88,6 +109,7 @@ class ProfileInstance {
 
    private:
     std::ostream& os;
+    const std::thread::id owner = std::this_thread::get_id();
     ProfileNode root{"root", nullptr};
     ProfileNode* current = &root;  // never set to nullptr
 
@@ -119,6 +141,8 @@ class ProfileInstance {
             throw std::runtime_error("Still in a profile scope: " + current->label);
         }
         print_profile_rec(root, 0);
+        os << "allocator: " << allocator_counters.hits << " hits | " << allocator_counters.misses << " misses | "
+           << allocator_counters.bytes_cached << " B cached\n";
         os << "----------------\n\n";
     }
 };
@@ -0,0 +1,48 @@
+#ifndef VGRAD_REDUCE_H_
+#define VGRAD_REDUCE_H_
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <algorithm>
+
+#include "elementwise.h"
+
+namespace vgrad::kernel {
+
+template <Size Outer, Size Reduce, Size Inner, typename Acc, typename Combine, typename In>
+void _reduce_axis(Acc* out, Acc init, const Combine& combine, const In& in) {
+    constexpr Size block = std::min<Size>(Inner, 1024);
+    constexpr Size blocks = (Inner + block - 1) / block;
+
+#pragma omp parallel for collapse(2) schedule(static) if (Outer * Reduce * Inner > grain_size)
+    for (Size o = 0; o < Outer; o++) {
+        for (Size b = 0; b < blocks; b++) {
+            const Size begin = b * block;
+            const Size width = std::min(block, Inner - begin);
+            Acc* acc = out + o * Inner + begin;
+            const Size base = o * Reduce * Inner + begin;
+
+            std::fill(acc, acc + width, init);
+            for (Size r = 0; r < Reduce; r++) {
+#pragma omp simd
+                for (Size j = 0; j < width; j++) acc[j] = combine(acc[j], in(base + r * Inner + j));
+            }
+        }
+    }
+}
+
+// Reduce the middle axis of a tensor viewed as Outer x Reduce x Inner:
+//   out[o * Inner + j] = combine(... combine(combine(init, in(o, 0, j)), in(o, 1, j)) ..., in(o, Reduce - 1, j))
+// where in() is called with the flat index (o * Reduce + r) * Inner + j. Outputs are accumulated in place a block of
+// j at a time, so every pass over r reads one contiguous run of the input. Blocks are independent and shared across
+// threads; the order of combine() calls for each output is always r = 0, 1, ...
+template <Size Outer, Size Reduce, Size Inner, typename Acc, typename Combine, typename In>
+void reduce_axis(Acc* out, Acc init, Combine combine, In in) {
+    _record([=] { _reduce_axis<Outer, Reduce, Inner>(out, init, combine, in); });
+}
+
+}  // namespace vgrad::kernel
+
+#endif  // VGRAD_REDUCE_H_
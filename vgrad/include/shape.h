@@ -52,6 +52,17 @@ struct Shape {
 
     static constexpr auto strides = compute_strides();
 
+    static constexpr auto compute_extents() {
+        std::array<Size, rank> result{};
+        result[0] = Outer::value;
+        for (Size i = 0; i < inner.rank; i++) {
+            result[i + 1] = inner.extents[i];
+        }
+        return result;
+    }
+
+    static constexpr auto extents = compute_extents();
+
     template <Index I>
         requires IsValidIndex<Shape<Outer, Inner>, I>
     static constexpr Size normalize_index() {
@@ -164,6 +175,9 @@ struct ScalarShape {
     static constexpr Size rank = 0;
     static constexpr Size flat_size = 1;
 
+    static constexpr std::array<Size, 0> strides{};
+    static constexpr std::array<Size, 0> extents{};
+
     template <Index I, IsDimension Dim>
         requires(I == 0)
     static constexpr auto insert() {
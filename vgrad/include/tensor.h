@@ -5,8 +5,12 @@
 #include <cassert>
 #include <iostream>
 #include <memory>
+#include <stdexcept>
 
+#include "arena.h"
 #include "complexity.h"
+#include "grad_mode.h"
+#include "layout.h"
 #include "profile.h"
 #include "shape.h"
 
@@ -27,15 +31,22 @@ constexpr std::string dtype_to_string() {
     }
 }
 
+// Tag for the Tensor constructor that leaves the data uninitialized, for kernels that write every element of their
+// result. Use zeros() or a default-constructed Tensor where the data must start at zero.
+struct Uninitialized {};
+inline constexpr Uninitialized uninitialized{};
+
 template <Number DType>
 using MemoryConstant = cx::Constant<sizeof(DType), "B">;
 
 using TimeConstant = cx::Constant<1, "ops">;
 
-template <IsShape _OutShape, Number _DType>
+// Leaves that require a gradient are parameters (see Param); the rest are constants, which backward() never reaches.
+template <IsShape _OutShape, Number _DType, bool _RequiresGrad = false>
 struct LeafNode {
     static constexpr bool is_node = true;
     static constexpr bool is_leaf_node = true;
+    static constexpr bool requires_grad = _RequiresGrad;
     using DType = _DType;
     using OutShape = _OutShape;
 
@@ -44,25 +55,42 @@ struct LeafNode {
     using TotalTimeComplexity = cx::MakeComplexity<cx::ConstProductTerm<TimeConstant, Cx>>;
 };
 
-template <IsShape _Shape, Number _DType, IsNode _Node = LeafNode<_Shape, _DType>>
-    requires std::is_same_v<typename _Node::OutShape, _Shape> && std::is_same_v<typename _Node::DType, _DType>
+// Layout says where each element lives in the underlying buffer. Views (transpose, repeat, ...) share their input's
+// buffer under a strided layout; see layout.h. Only contiguous tensors expose their data as flat or nested arrays.
+template <IsShape _Shape, Number _DType, IsNode _Node = LeafNode<_Shape, _DType>,
+          IsLayout _Layout = ContiguousLayout<_Shape>>
+    requires std::is_same_v<typename _Node::OutShape, _Shape> && std::is_same_v<typename _Node::DType, _DType> &&
+             std::is_same_v<typename _Layout::Shape, _Shape>
 class Tensor {
    public:
     using Shape = _Shape;
     using DType = _DType;
     using Node = _Node;
+    using Layout = _Layout;
     using FlatData = std::array<DType, Shape::flat_size>;
+    using Storage = std::array<DType, Layout::storage_size>;
     using NestedData = NestedArray<Shape, DType>;
-    using Detached = Tensor<Shape, DType>;
+    using Detached = Tensor<Shape, DType, LeafNode<Shape, DType>, Layout>;
+    using Contiguous = Tensor<Shape, DType>;
+
+    static constexpr bool requires_grad = Node::requires_grad;
 
     static constexpr auto mem_complexity = typename Node::TotalMemoryComplexity{};
     static constexpr auto time_complexity = typename Node::TotalTimeComplexity{};
 
     // data is initialized to zeros
-    Tensor(Node&& node = Node{}) : data_{std::make_shared<FlatData>()}, node_{std::make_shared<Node>(node)} {}
+    Tensor(Node&& node = Node{})
+        requires Layout::is_contiguous
+        : data_{_retain(_make_shared<FlatData>())}, node_{make_node(std::move(node))} {}
+
+    // data is left uninitialized
+    Tensor(Uninitialized, Node&& node = Node{})
+        requires Layout::is_contiguous
+        : data_{_retain(_make_shared_for_overwrite<FlatData>())}, node_{make_node(std::move(node))} {}
 
     Tensor(const NestedData& data, Node&& node = Node{})
-        : data_{std::make_shared<FlatData>()}, node_{std::make_shared<Node>(node)} {
+        requires Layout::is_contiguous
+        : data_{_retain(_make_shared<FlatData>())}, node_{make_node(std::move(node))} {
         if constexpr (Shape::rank == 0) {
             (*data_)[0] = data;
         } else {
@@ -71,51 +99,72 @@ class Tensor {
         }
     }
 
-    Tensor(const std::shared_ptr<FlatData>& data, Node&& node = Node{})
-        : data_{data}, node_{std::make_shared<Node>(node)} {
-        assert(data_->size() == Shape::flat_size);
+    Tensor(const std::shared_ptr<Storage>& data, Node&& node = Node{})
+        : data_{data}, node_{make_node(std::move(node))} {
+        assert(data_->size() == Layout::storage_size);
     }
 
-    const FlatData& flat_view() const { return *data_; }
+    const FlatData& flat_view() const
+        requires Layout::is_contiguous
+    {
+        return *data_;
+    }
 
     const NestedData& nested_view() const
-        requires(Shape::rank > 0)
+        requires(Shape::rank > 0 && Layout::is_contiguous)
     {
         return *reinterpret_cast<const NestedData*>(data_->data());
     }
 
+    // the whole underlying buffer, indexed through Layout::storage_index()
+    const Storage& storage_view() const { return *data_; }
+
+    // element at a row-major flat index, for any layout
+    DType flat_at(Size index) const { return (*data_)[Layout::storage_index(index)]; }
+
     const auto value() const
         requires(Shape::rank == 0)
     {
-        return flat_view()[0];
+        return (*data_)[Layout::offset];
     }
 
     const auto& operator[](Size index) const
-        requires(Shape::rank > 0)
+        requires(Shape::rank > 0 && Layout::is_contiguous)
     {
         return nested_view()[index];
     }
 
     template <typename T>
     auto& operator-=(const T& other)
-        requires IsLeafNode<Node>
+        requires IsLeafNode<Node> && Layout::is_contiguous
     {
+        // replays would keep writing to the old buffer
+        if (_current_capture) throw std::runtime_error("operator-= in a captured step; use an optimizer instead");
         auto result = *this - other;
-        this->data_ = std::make_shared<FlatData>(result.flat_view());
+        // the leaf outlives the step, so its data stays off any arena
+        this->data_ = _make_cached<FlatData>(result.flat_view());
         return *this;
     }
 
     auto detach() const { return Detached{data_}; }
 
-    const auto get_data() const { return data_; }
+    // the same data as a parameter, a leaf that gradients are computed for; the data stays where it is, so a
+    // parameter made inside an ArenaScope would live on the arena (see Arena)
+    auto as_param() const { return Tensor<Shape, DType, LeafNode<Shape, DType, true>, Layout>{data_}; }
 
-    const auto get_node() const { return node_; }
+    const std::shared_ptr<Storage>& get_data() const { return data_; }
+
+    const std::shared_ptr<Node>& get_node() const { return node_; }
 
     void _init_entry(Size index, DType value) { (*data_)[index] = value; }
 
     // Escape hatch for mutating the data on init. If only viewing, use
     // flat_view() instead.
-    FlatData& _flat_data() { return *data_; }
+    FlatData& _flat_data()
+        requires Layout::is_contiguous
+    {
+        return *data_;
+    }
 
     auto& bind_profile(profile::ProfileNode& profile_node) const {
         profile_node.add_hook([](profile::ProfileHookDuration duration, std::ostream& os) {
@@ -138,37 +187,57 @@ class Tensor {
     }
 
    private:
-    std::shared_ptr<FlatData> data_;
+    std::shared_ptr<Storage> data_;
+    // null for tensors that backward() never reaches: constants, and results of ops run under a NoGradGuard
     std::shared_ptr<Node> node_;
+
+    static std::shared_ptr<Node> make_node(Node&& node) {
+        if constexpr (!Node::requires_grad) {
+            return nullptr;
+        } else if constexpr (IsLeafNode<Node>) {
+            // parameters need a node whatever the mode, since backward() identifies them by it
+            return std::make_shared<Node>(std::move(node));
+        } else {
+            return is_grad_enabled() ? _make_shared<Node>(std::move(node)) : nullptr;
+        }
+    }
 };
 
-template <IsShape Shape, Number DType, typename Node>
+// A tensor that gradients are computed for, e.g. a model parameter:
+//
+//   Param<MakeShape<In, Out>, float> w = randn<float, MakeShape<In, Out>>().as_param();
+//
+// requires_grad propagates from parameters to everything computed from them. Other tensors are constants: the ops
+// record no gradient function for them, and backward() leaves them out.
+template <IsShape Shape, Number DType>
+using Param = Tensor<Shape, DType, LeafNode<Shape, DType, true>>;
+
+template <IsShape Shape, Number DType, typename Node, typename Layout>
     requires(Shape::rank == 0)
-std::ostream& operator<<(std::ostream& os, const Tensor<Shape, DType, Node>& tensor) {
+std::ostream& operator<<(std::ostream& os, const Tensor<Shape, DType, Node, Layout>& tensor) {
     os << tensor.value();
     return os;
 }
 
-template <IsShape Shape, Number DType, typename Node>
+template <IsShape Shape, Number DType, typename Node, typename Layout>
     requires(Shape::rank == 1)
-std::ostream& operator<<(std::ostream& os, const Tensor<Shape, DType, Node>& tensor) {
-    const auto& data = tensor.nested_view();
+std::ostream& operator<<(std::ostream& os, const Tensor<Shape, DType, Node, Layout>& tensor) {
     os << "[ ";
     for (Size i = 0; i < Shape::flat_size; i++) {
-        os << data[i] << ' ';
+        os << tensor.flat_at(i) << ' ';
     }
     os << "]";
     return os;
 }
 
-template <IsShape Shape, Number DType, typename Node>
+template <IsShape Shape, Number DType, typename Node, typename Layout>
     requires(Shape::rank == 2)
-std::ostream& operator<<(std::ostream& os, const Tensor<Shape, DType, Node>& tensor) {
-    const auto& data = tensor.nested_view();
+std::ostream& operator<<(std::ostream& os, const Tensor<Shape, DType, Node, Layout>& tensor) {
+    constexpr Size cols = Shape::template At<-1>::value;
     os << "[\n";
-    for (const auto& row : data) {
-        for (const auto& elem : row) {
-            os << elem << ' ';
+    for (Size i = 0; i < Shape::flat_size; i += cols) {
+        for (Size j = 0; j < cols; j++) {
+            os << tensor.flat_at(i + j) << ' ';
         }
         os << '\n';
     }
@@ -177,7 +246,11 @@ std::ostream& operator<<(std::ostream& os, const Tensor<Shape, DType, Node>& ten
 }
 
 template <typename T>
-concept IsTensor = std::is_same_v<T, Tensor<typename T::Shape, typename T::DType, typename T::Node>>;
+concept IsTensor =
+    std::is_same_v<T, Tensor<typename T::Shape, typename T::DType, typename T::Node, typename T::Layout>>;
+
+template <typename T>
+concept IsContiguousTensor = IsTensor<T> && T::Layout::is_contiguous;
 
 template <typename A>
 concept IsIntegralTensor = IsTensor<A> && std::is_integral_v<typename A::DType>;
@@ -201,8 +274,14 @@ concept TensorShapeBroadcastCompatible =
                    typename B::Shape::template Last<std::min(A::Shape::rank, B::Shape::rank)>>;
 
 template <typename A, typename B>
-concept TensorMatmulCompatible = IsTensor<A> && IsTensor<B> && A::Shape::rank >= 2 && B::Shape::rank >= 2 &&
-                                 A::Shape::template At<-1>::value == B::Shape::template At<-2>::value;
+concept TensorMatmulCompatible =
+    IsTensor<A> && IsTensor<B> && A::Shape::rank >= 2 && B::Shape::rank >= 2 &&
+    A::Shape::template At<-1>::value == B::Shape::template At<-2>::value &&
+    // batch dimensions (all but the last two) must broadcast
+    std::is_same_v<typename A::Shape::template Last<std::min(A::Shape::rank, B::Shape::rank)>::template Remove<-1>::
+                       template Remove<-1>,
+                   typename B::Shape::template Last<std::min(A::Shape::rank, B::Shape::rank)>::template Remove<-1>::
+                       template Remove<-1>>;
 
 }  // namespace vgrad
 
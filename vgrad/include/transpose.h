@@ -0,0 +1,154 @@
+#ifndef VGRAD_TRANSPOSE_H_
+#define VGRAD_TRANSPOSE_H_
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <algorithm>
+
+#include "elementwise.h"
+
+namespace vgrad::kernel {
+
+// Transposes a Size x Size block held in registers: out[c * out_rs + r] = in[r * in_rs + c]. The generic version is a
+// single element; float and double use 4x4 and 2x2 shuffles where the target has 128-bit vectors.
+template <Number DType>
+struct TransposeBlock {
+    static constexpr Size size = 1;
+    static void apply(const DType* in, Size, DType* out, Size) { *out = *in; }
+};
+
+#if defined(__SSE2__)
+
+template <>
+struct TransposeBlock<float> {
+    static constexpr Size size = 4;
+    static void apply(const float* in, Size in_rs, float* out, Size out_rs) {
+        __m128 r0 = _mm_loadu_ps(in);
+        __m128 r1 = _mm_loadu_ps(in + in_rs);
+        __m128 r2 = _mm_loadu_ps(in + 2 * in_rs);
+        __m128 r3 = _mm_loadu_ps(in + 3 * in_rs);
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+        _mm_storeu_ps(out, r0);
+        _mm_storeu_ps(out + out_rs, r1);
+        _mm_storeu_ps(out + 2 * out_rs, r2);
+        _mm_storeu_ps(out + 3 * out_rs, r3);
+    }
+};
+
+template <>
+struct TransposeBlock<double> {
+    static constexpr Size size = 2;
+    static void apply(const double* in, Size in_rs, double* out, Size out_rs) {
+        __m128d r0 = _mm_loadu_pd(in);
+        __m128d r1 = _mm_loadu_pd(in + in_rs);
+        _mm_storeu_pd(out, _mm_unpacklo_pd(r0, r1));
+        _mm_storeu_pd(out + out_rs, _mm_unpackhi_pd(r0, r1));
+    }
+};
+
+#elif defined(__ARM_NEON)
+
+template <>
+struct TransposeBlock<float> {
+    static constexpr Size size = 4;
+    static void apply(const float* in, Size in_rs, float* out, Size out_rs) {
+        float32x4x2_t t01 = vtrnq_f32(vld1q_f32(in), vld1q_f32(in + in_rs));
+        float32x4x2_t t23 = vtrnq_f32(vld1q_f32(in + 2 * in_rs), vld1q_f32(in + 3 * in_rs));
+        vst1q_f32(out, vcombine_f32(vget_low_f32(t01.val[0]), vget_low_f32(t23.val[0])));
+        vst1q_f32(out + out_rs, vcombine_f32(vget_low_f32(t01.val[1]), vget_low_f32(t23.val[1])));
+        vst1q_f32(out + 2 * out_rs, vcombine_f32(vget_high_f32(t01.val[0]), vget_high_f32(t23.val[0])));
+        vst1q_f32(out + 3 * out_rs, vcombine_f32(vget_high_f32(t01.val[1]), vget_high_f32(t23.val[1])));
+    }
+};
+
+#if defined(__aarch64__)
+template <>
+struct TransposeBlock<double> {
+    static constexpr Size size = 2;
+    static void apply(const double* in, Size in_rs, double* out, Size out_rs) {
+        float64x2_t r0 = vld1q_f64(in);
+        float64x2_t r1 = vld1q_f64(in + in_rs);
+        vst1q_f64(out, vzip1q_f64(r0, r1));
+        vst1q_f64(out + out_rs, vzip2q_f64(r0, r1));
+    }
+};
+#endif
+
+#endif
+
+// Transpose a rows x cols tile of runs of Inner elements. Rows of the input are in_rs apart and rows of the output are
+// out_rs apart.
+template <Size Inner, Number DType>
+void _transpose_tile(const DType* in, Size in_rs, DType* out, Size out_rs, Size rows, Size cols) {
+    if constexpr (Inner == 1) {
+        using Block = TransposeBlock<DType>;
+        const Size rows_end = rows - rows % Block::size;
+        const Size cols_end = cols - cols % Block::size;
+
+        for (Size r = 0; r < rows_end; r += Block::size) {
+            for (Size c = 0; c < cols_end; c += Block::size) {
+                Block::apply(in + r * in_rs + c, in_rs, out + c * out_rs + r, out_rs);
+            }
+        }
+        // ragged right and bottom edges
+        for (Size r = 0; r < rows; r++) {
+            for (Size c = r < rows_end ? cols_end : 0; c < cols; c++) out[c * out_rs + r] = in[r * in_rs + c];
+        }
+    } else {
+        for (Size r = 0; r < rows; r++) {
+            for (Size c = 0; c < cols; c++) {
+                std::copy_n(in + r * in_rs + c * Inner, Inner, out + c * out_rs + r * Inner);
+            }
+        }
+    }
+}
+
+template <Size Outer, Size Rows, Size Mid, Size Cols, Size Inner, Number DType>
+void _transpose(const DType* in, DType* out) {
+    constexpr Size tile = std::max<Size>(32 / Inner, 1);
+    constexpr Size row_tiles = (Rows + tile - 1) / tile;
+    constexpr Size col_tiles = (Cols + tile - 1) / tile;
+
+    constexpr Size in_rs = Mid * Cols * Inner;
+    constexpr Size out_rs = Mid * Rows * Inner;
+
+#pragma omp parallel for collapse(3) schedule(static) if (Outer * Rows * Mid * Cols * Inner > grain_size)
+    for (Size om = 0; om < Outer * Mid; om++) {
+        for (Size rt = 0; rt < row_tiles; rt++) {
+            for (Size ct = 0; ct < col_tiles; ct++) {
+                const Size o = om / Mid;
+                const Size m = om % Mid;
+                const Size r = rt * tile;
+                const Size c = ct * tile;
+
+                const DType* in_tile = in + o * Rows * in_rs + m * Cols * Inner + r * in_rs + c * Inner;
+                DType* out_tile = out + o * Cols * out_rs + m * Rows * Inner + c * out_rs + r * Inner;
+                _transpose_tile<Inner>(in_tile, in_rs, out_tile, out_rs, std::min(tile, Rows - r),
+                                       std::min(tile, Cols - c));
+            }
+        }
+    }
+}
+
+// Swap the Rows and Cols axes of a contiguous Outer x Rows x Mid x Cols x Inner tensor:
+//   out[o][c][m][r][k] = in[o][r][m][c][k]
+// Any transpose of two axes of a row-major tensor has this form. Each (o, m) slice is a strided Rows x Cols
+// transpose, which is done in square tiles small enough that both the rows read and the rows written stay in L1.
+// Tiles are independent and shared across threads, and no index is ever divided per element.
+template <Size Outer, Size Rows, Size Mid, Size Cols, Size Inner, Number DType>
+void transpose(const DType* in, DType* out) {
+    _record([=] { _transpose<Outer, Rows, Mid, Cols, Inner>(in, out); });
+}
+
+}  // namespace vgrad::kernel
+
+#endif  // VGRAD_TRANSPOSE_H_
@@ -18,6 +18,11 @@ concept IsShape = requires {
     { T::is_shape } -> std::same_as<const bool&>;
 } && T::is_shape;
 
+template <typename T>
+concept IsLayout = requires {
+    { T::is_layout } -> std::same_as<const bool&>;
+} && T::is_layout;
+
 template <typename T>
 concept IsNode = requires {
     { T::is_node } -> std::same_as<const bool&>;
@@ -38,6 +43,16 @@ concept IsBinaryNode = IsNode<T> && requires {
     { T::is_binary_node } -> std::same_as<const bool&>;
 } && T::is_binary_node;
 
+template <typename T>
+concept IsFusedNode = IsNode<T> && requires {
+    { T::is_fused_node } -> std::same_as<const bool&>;
+} && T::is_fused_node;
+
+template <typename T>
+concept IsCheckpointNode = IsNode<T> && requires {
+    { T::is_checkpoint_node } -> std::same_as<const bool&>;
+} && T::is_checkpoint_node;
+
 template <typename T>
 concept Number = std::is_arithmetic_v<T>;
 
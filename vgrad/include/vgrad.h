@@ -1,7 +1,12 @@
 #ifndef VGRAD_H_
 #define VGRAD_H_
 
+#include "arena.h"
+#include "capture.h"
+#include "checkpoint.h"
 #include "create_tensor.h"
+#include "forward.h"
+#include "micro_batch.h"
 #include "module.h"
 #include "ops.h"
 #include "optimizers.h"
@@ -23,7 +23,7 @@ auto import_vgtensor(std::string filename) {
 
     file.seekg(0, std::ios::beg);
 
-    Tensor<Shape, DType> result;
+    Tensor<Shape, DType> result{uninitialized};
     file.read(reinterpret_cast<char*>(result._flat_data().data()), sizeof(DType) * Shape::flat_size);
     return result;
 }
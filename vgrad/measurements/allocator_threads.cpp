@@ -0,0 +1,40 @@
+#include <omp.h>
+
+#include "vgrad.h"
+
+using namespace vgrad;
+
+// Trains on a loss with many small independent branches, whose gradients backward() frees in tasks on other threads,
+// and checks that the caching allocator stops growing once training has warmed up.
+int main() {
+    omp_set_num_threads(8);
+
+    using Dim = Dimension<64>;
+    using Shape = MakeShape<Dim, Dim>;
+    Param<Shape, float> a = randn<float, Shape>().as_param();
+    Param<Shape, float> b = randn<float, Shape>().as_param();
+    Param<Shape, float> c = randn<float, Shape>().as_param();
+    Param<Shape, float> d = randn<float, Shape>().as_param();
+    auto x = randn<float, Shape>();
+
+    optim::SGD optimizer{0.0001f, a, b, c, d};
+    auto train = [&](int steps) {
+        for (int i = 0; i < steps; i++) {
+            auto loss = sum(sum(exp(a * x) + sin(b * x) + cos(c * x) + relu(d * x) + a * b + c * d));
+            optimizer.step(loss);
+        }
+    };
+
+    auto& counters = profile::allocator_counters;
+    train(1000);
+    const std::size_t warm_cached = counters.bytes_cached;
+    const std::size_t warm_misses = counters.misses;
+    train(2000);
+
+    std::cout << "cached: " << warm_cached << " B -> " << counters.bytes_cached << " B" << std::endl;
+    std::cout << "misses: " << warm_misses << " -> " << counters.misses << std::endl;
+
+    // what each thread may keep of every size class, for the largest blocks here
+    const std::size_t bound = omp_get_max_threads() * _StorageCache::max_blocks * Shape::flat_size * sizeof(float);
+    return counters.bytes_cached <= warm_cached + bound ? 0 : 1;
+}
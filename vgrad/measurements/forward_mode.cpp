@@ -0,0 +1,37 @@
+#include "vgrad.h"
+
+using namespace vgrad;
+
+// Largest difference between the gradients of forward_grad() and backward() on the same loss.
+template <typename LossFn, IsTensor Param>
+double max_difference(const LossFn& loss_fn, const Param& w) {
+    auto [reverse] = backward(loss_fn(), w);
+    auto [loss, grads] = forward_grad(loss_fn, w);
+    auto [forward] = grads;
+
+    double result = 0;
+    for (Size i = 0; i < Param::Shape::flat_size; i++) {
+        result = std::max(result, std::abs(forward.flat_view()[i] - reverse.flat_view()[i]));
+    }
+    return result;
+}
+
+int main() {
+    using Shape = MakeShape<Dimension<4>, Dimension<3>>;
+    Param<Shape, double> w = randn<double, Shape>().as_param();
+    auto x = randn<double, Shape>();
+
+    double worst = 0;
+    auto check = [&](const char* name, const auto& loss_fn) {
+        double difference = max_difference(loss_fn, w);
+        worst = std::max(worst, difference);
+        std::cout << name << ": " << difference << std::endl;
+    };
+
+    check("w * x", [&] { return sum(sum(w * x)); });
+    check("w * detach(w)", [&] { return sum(sum(w * w.detach())); });
+    check("matmul(w, transpose(detach(w)))", [&] { return sum(sum(matmul(w, transpose<0, 1>(w.detach())))); });
+    check("exp(w - detach(w)) * w", [&] { return sum(sum(exp(w - w.detach()) * w)); });
+
+    return worst < 1e-9 ? 0 : 1;
+}
@@ -23,7 +23,7 @@ template <Size N>
 void measure() {
     using Dim = Dimension<N>;
     auto mat = zeros<float, MakeShape<Dim, Dim>>();
-    transpose<0, 1>(mat);
+    contiguous(transpose<0, 1>(mat));
     dumb_transpose<N>(mat);
 }
 